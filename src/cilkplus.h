@@ -4,14 +4,29 @@
 #include <cilk/cilk.h>
 #include <cilk/cilk_api.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
 
 #define fibril
 #define fibril_t __attribute__((unused)) int
 #define fibril_init(fp)
 #define fibril_join(fp) cilk_sync
 
+#define fibril_token_t __attribute__((unused)) int
+#define fibril_token_init(fp, tk) ((void) (fp), (void) (tk))
+#define fibril_cancel(tk) ((void) (tk))
+#define fibril_cancelled() (0)
+#define fibril_stack_hint(fp, size) ((void) (fp), (void) (size))
+#define fibril_rt_prealloc(n) ((void) (n))
+#define fibril_rt_set_nprocs(n) ((void) (n))
+#define fibril_sleep_ns(ns) do { \
+  struct timespec _ts = { (time_t) ((ns) / 1000000000), \
+    (long) ((ns) % 1000000000) }; \
+  nanosleep(&_ts, NULL); \
+} while (0)
+
 #define fibril_fork_nrt(fp, fn, ag)     cilk_spawn fn ag
 #define fibril_fork_wrt(fp, rt, fn, ag) *rt = cilk_spawn fn ag
 
@@ -22,7 +37,8 @@
 	if (l > INT_MAX) l = INT_MAX; \
 	snprintf(nprocs, 32, "%d", (int) ((n > 0 && n < l) ? n : l)); \
 	__cilkrts_set_param("nworkers", nprocs); \
-	__cilkrts_set_param("stack size", "0x100000"); \
+	const char * stack_size = getenv("FIBRIL_STACK_SIZE"); \
+	__cilkrts_set_param("stack size", stack_size ? stack_size : "0x100000"); \
 } while (0);
 #define fibril_rt_exit() (__cilkrts_end_cilk())
 #define fibril_rt_nprocs() (__cilkrts_get_nworkers())
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "safe.h"
+#include "sync.h"
+#include "cores.h"
+#include "param.h"
+
+/**
+ * Sharing of the cores between runtimes.
+ *
+ * With PARAM_SHARE_CORES, the runtimes that name the same shared memory
+ * segment hand out its tokens, one per online core, among their workers.
+ * A worker must hold a token to steal. It keeps the token while it runs
+ * what it stole, and hands it back once it has failed to steal for a
+ * while, so the workers that look for work across all runtimes never
+ * outnumber the cores. Running a worker's own deque, the ready frames and
+ * the main fibril needs no token, so every runtime still makes progress
+ * when the others hold all of them; a worker that starts one of them takes
+ * a token if one is free. Only while all the tokens are taken can such
+ * workers make the running workers outnumber the cores.
+ *
+ * A token holds the pid of its owner, or 0 if it is free. A worker that
+ * finds none free, or has just handed its own back, sleeps CORES_WAIT_US
+ * microseconds before it looks again; releases wake nobody, or the idle
+ * workers of idle runtimes would keep waking each other. Every
+ * CORES_SWEEP_WAITS waits, a worker frees the tokens of owners that have
+ * died without releasing them.
+ *
+ * Every runtime holds a shared flock() on the segment while it is
+ * attached, which the kernel drops if it dies. The runtime that gets the
+ * lock to itself as it detaches is the last one, and unlinks the segment;
+ * one that attaches to a segment that has just been unlinked opens it
+ * again.
+ */
+#ifndef CORES_WAIT_US
+#define CORES_WAIT_US 1000
+#endif
+
+#ifndef CORES_SWEEP_WAITS
+#define CORES_SWEEP_WAITS 64
+#endif
+
+struct _cores_t {
+  int ncores;
+  struct {
+    int volatile owner;
+  } __attribute__((aligned(64))) token[];
+};
+
+static struct _cores_t * _cores;
+static size_t _size;
+static pid_t _pid;
+static int _fd;
+
+/** The token of this worker plus 1, or 0. */
+static __thread int _token;
+static __thread unsigned _waits;
+
+void cores_init(void)
+{
+  if (!PARAM_SHARE_CORES) return;
+
+  int ncores = sysconf(_SC_NPROCESSORS_ONLN);
+  _size = sizeof(struct _cores_t) + ncores * sizeof(_cores->token[0]);
+  _pid = getpid();
+
+  struct stat st;
+
+  do {
+    _fd = shm_open(PARAM_SHARE_CORES, O_RDWR | O_CREAT, 0600);
+    SAFE_ASSERT(_fd >= 0);
+    SAFE_NNCALL(flock(_fd, LOCK_SH));
+    SAFE_NNCALL(fstat(_fd, &st));
+    if (st.st_nlink == 0) close(_fd);
+  } while (st.st_nlink == 0);
+
+  /** Any runtime may create the segment; they agree on its size. */
+  SAFE_NNCALL(ftruncate(_fd, _size));
+  _cores = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  SAFE_ASSERT(_cores != MAP_FAILED);
+
+  _cores->ncores = ncores;
+}
+
+void cores_exit(void)
+{
+  if (!_cores) return;
+
+  SAFE_NNCALL(munmap(_cores, _size));
+  _cores = NULL;
+
+  /** Of two runtimes that detach at once, the one that locks last wins. */
+  SAFE_NNCALL(flock(_fd, LOCK_UN));
+  if (flock(_fd, LOCK_EX | LOCK_NB) == 0) shm_unlink(PARAM_SHARE_CORES);
+  close(_fd);
+}
+
+/** Free the tokens of owners that are gone. */
+static void cores_sweep(void)
+{
+  int i;
+
+  for (i = 0; i < _cores->ncores; ++i) {
+    int owner = fatomic_load(_cores->token[i].owner);
+
+    if (owner && kill(owner, 0) != 0 && errno == ESRCH) {
+      sync_cas(&_cores->token[i].owner, owner, 0);
+    }
+  }
+}
+
+/**
+ * Make sure that the worker holds a token.
+ * @return Return 0 if every token is taken.
+ */
+int cores_hold(void)
+{
+  if (!_cores || _token) return 1;
+
+  int ncores = _cores->ncores;
+  int i = _tid % ncores;
+  int n;
+
+  for (n = 0; n < ncores; ++n, i = (i + 1) % ncores) {
+    if (fatomic_load(_cores->token[i].owner) == 0 &&
+        sync_cas(&_cores->token[i].owner, 0, _pid) == 0) {
+      _token = i + 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Hand the token of the worker back.
+ * @return Return 0 if the worker held none.
+ */
+int cores_release(void)
+{
+  if (!_token) return 0;
+
+  fatomic_store(_cores->token[_token - 1].owner, 0);
+  _token = 0;
+  return 1;
+}
+
+void cores_wait(void)
+{
+  if (!_cores) return;
+
+  struct timespec ts = {
+    .tv_sec = 0,
+    .tv_nsec = CORES_WAIT_US * 1000
+  };
+
+  nanosleep(&ts, NULL);
+  if (++_waits % CORES_SWEEP_WAITS == 0) cores_sweep();
+}
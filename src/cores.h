@@ -0,0 +1,17 @@
+#ifndef CORES_H
+#define CORES_H
+
+/**
+ * With PARAM_SHARE_CORES, a worker must hold one of the tokens, one per
+ * online core, that all the runtimes on the segment share, to steal. The
+ * main fibril, frames resumed from the ready list and frames left in a
+ * worker's own deque run without one when none is free, so the running
+ * workers may then outnumber the cores.
+ */
+void cores_init(void);
+void cores_exit(void);
+int  cores_hold(void);
+int  cores_release(void);
+void cores_wait(void);
+
+#endif /* end of include guard: CORES_H */
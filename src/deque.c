@@ -2,10 +2,28 @@
 #include "sync.h"
 #include "debug.h"
 #include "deque.h"
+#include "stats.h"
 
 __thread deque_t fibrili_deq;
 
 #ifdef DEQUE_USE_THE
+/**
+ * A cancelled continuation is left to its owner, which runs through it
+ * cheaply by polling fibril_cancelled(), instead of costing a thief a stack.
+ * Only this deque can tell, since its lock pins the frame while the token
+ * is read; the lock-free deque steals cancelled continuations like any
+ * other, and never counts N_CANCELS.
+ */
+static inline int cancelled(struct _fibril_t * frptr)
+{
+  if (fibrili_cancelled(frptr->token.cur)) {
+    STATS_COUNT(N_CANCELS, 1);
+    return 1;
+  }
+
+  return 0;
+}
+
 struct _fibril_t * deque_steal(deque_t * deq)
 {
   if (deq->head >= deq->tail) return NULL;
@@ -25,10 +43,26 @@ struct _fibril_t * deque_steal(deque_t * deq)
 
   struct _fibril_t * frptr = deq->buff[head];
 
+  if (cancelled(frptr)) {
+    deq->head--;
+    frptr = NULL;
+  }
+
   sync_unlock(deq->lock);
   return frptr;
 }
 
+/** Take the youngest frame of the calling worker's deque like a thief. */
+struct _fibril_t * deque_pop(void)
+{
+  int tail = fibrili_deq.tail;
+
+  if (tail <= fibrili_deq.head) return NULL;
+
+  struct _fibril_t * frptr = fibrili_deq.buff[tail - 1];
+  return fibrili_pop() ? frptr : NULL;
+}
+
 #else
 
 struct _fibril_t * deque_steal(deque_t * deq)
@@ -41,10 +75,27 @@ start:
 
   void *frptr = deq->buff[head % DEQUE_SIZE];
 
+  /**
+   * The owner may have popped the frame since, and the token that a stale
+   * frame points to may be gone. Once the CAS has pinned the frame it is
+   * too late to leave it to the owner, so cancelled continuations are only
+   * left behind by the THE deque, which pins the frame under the lock.
+   */
   if (!fatomic_cas_e(deq->head, head, head + 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
     goto start;
 
   return frptr;
 }
+
+/** Take the youngest frame of the calling worker's deque like a thief. */
+struct _fibril_t * deque_pop(void)
+{
+  uint64_t tail = fatomic_load_e(fibrili_deq.tail, __ATOMIC_RELAXED);
+
+  if (tail <= fatomic_load(fibrili_deq.head)) return NULL;
+
+  struct _fibril_t * frptr = fibrili_deq.buff[(tail - 1) % DEQUE_SIZE];
+  return fibrili_pop() ? frptr : NULL;
+}
 #endif
 
@@ -6,5 +6,6 @@
 typedef struct _fibrili_deque_t deque_t;
 
 struct _fibril_t * deque_steal(deque_t * deq);
+struct _fibril_t * deque_pop(void);
 
 #endif /* end of include guard: DEQUE_H */
@@ -14,6 +14,9 @@ extern "C" {
 /** fibril_t. */
 typedef struct _fibril_t fibril_t;
 
+/** fibril_token_t. */
+typedef struct _fibril_token_t fibril_token_t;
+
 /** fibril_init. */
 __attribute__((always_inline)) extern inline
 void fibril_init(fibril_t * frptr)
@@ -28,6 +31,9 @@ void fibril_init(fibril_t * frptr)
   frptr->stack.btm = rbp;
   frptr->stack.top = rsp;
   frptr->stack.ptr = fibrili_deq.stack;
+  frptr->stack.hint = 0;
+  frptr->token.cur = fibrili_deq.token;
+  frptr->token.prev = fibrili_deq.token;
 }
 
 /** fibril_join. */
@@ -39,6 +45,102 @@ void fibril_join(fibril_t * frptr)
     frptr->steals = 0;
     frptr->resumable = 0;
   }
+
+  frptr->token.cur = frptr->token.prev;
+  fibrili_deq.token = frptr->token.prev;
+}
+
+/**
+ * fibril_token_init.
+ * Every fibril forked from frptr until the next fibril_join(frptr) runs
+ * under tk, and is cancelled together with tk or any enclosing token.
+ */
+__attribute__((always_inline)) extern inline
+void fibril_token_init(fibril_t * frptr, fibril_token_t * tk)
+{
+  tk->parent = frptr->token.cur;
+  tk->cancelled = 0;
+  tk->state = 0;
+  frptr->token.cur = tk;
+  fibrili_deq.token = tk;
+}
+
+/** fibril_cancel. */
+__attribute__((always_inline)) extern inline
+void fibril_cancel(fibril_token_t * tk)
+{
+  fatomic_store(tk->cancelled, 1);
+  fatomic_fadd(fibrili_epoch, 1);
+}
+
+/**
+ * fibril_park.
+ * Suspend the calling fibril until fibril_unpark(frptr). frptr must be a
+ * fibril_t initialized in the calling function that has not forked, and it
+ * must be published to the waker before parking. An unpark that happens
+ * before the park is not lost: the park then returns right away.
+ */
+__attribute__((always_inline)) extern inline
+void fibril_park(fibril_t * frptr)
+{
+  void * rsp;
+
+  /**
+   * The frame may be parked from a stolen continuation, so record the stack
+   * it runs on now rather than the one seen by fibril_init().
+   */
+  __asm__ __volatile__ ( "mov\t%%rsp,%0" : "=r" (rsp) );
+  frptr->stack.top = rsp;
+  frptr->stack.ptr = fibrili_deq.stack;
+  frptr->steals = (uint32_t) -1;
+  fibril_join(frptr);
+}
+
+/** fibril_unpark. */
+__attribute__((always_inline)) extern inline
+void fibril_unpark(fibril_t * frptr)
+{
+  fibrili_unpark(frptr);
+}
+
+/**
+ * fibril_sleep_ns.
+ * Suspend the calling fibril for at least ns nanoseconds. The worker does
+ * not block: it files the fibril into its timer wheel and goes on stealing,
+ * and the fibril is resumed by any idle worker once the wheel expires it.
+ * The wheel is only advanced while its worker is idle, so a busy worker may
+ * wake its sleepers late, but never early.
+ */
+__attribute__((always_inline)) extern inline
+void fibril_sleep_ns(uint64_t ns)
+{
+  fibril_t fr;
+  struct _fibrili_timer_t tm;
+
+  fibril_init(&fr);
+  tm.frptr = &fr;
+  fibrili_sleep(&tm, ns);
+  fibril_park(&fr);
+}
+
+/**
+ * fibril_stack_hint.
+ * A continuation of frptr that is stolen after this call runs on a stack
+ * of the smallest size class that holds size bytes. Calling it before a
+ * fibril_fork makes the hint specific to that fork site. 0, the default,
+ * asks for a full-sized stack.
+ */
+__attribute__((always_inline)) extern inline
+void fibril_stack_hint(fibril_t * frptr, uint64_t size)
+{
+  frptr->stack.hint = size;
+}
+
+/** fibril_cancelled. */
+__attribute__((always_inline)) extern inline
+int fibril_cancelled(void)
+{
+  return fibrili_cancelled(fibrili_deq.token);
 }
 
 #include "fork.h"
@@ -97,6 +199,24 @@ extern int fibril_rt_init(int nprocs);
 extern int fibril_rt_exit();
 extern int fibril_rt_nprocs();
 
+/**
+ * fibril_rt_prealloc.
+ * Allocate n more stacks per worker and fault in their top pages. This
+ * runs on the calling worker and leaves the stacks to the pools it puts
+ * them into; setting FIBRIL_PREALLOC_STACKS=n instead has every worker do
+ * it for itself, in parallel, as it starts in fibril_rt_init().
+ */
+extern int fibril_rt_prealloc(int n);
+
+/**
+ * fibril_rt_set_nprocs.
+ * Keep only the first n of the fibril_rt_nprocs() workers stealing. The
+ * others finish what they are running and sleep until a later call brings
+ * them back; n cannot exceed the count the runtime started with.
+ * Return -1 if n is out of range.
+ */
+extern int fibril_rt_set_nprocs(int n);
+
 #ifdef __cplusplus
 }
 #endif
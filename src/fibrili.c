@@ -1,19 +1,184 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include "pool.h"
+#include "cores.h"
 #include "sync.h"
 #include "stack.h"
+#include "mutex.h"
 #include "debug.h"
 #include "deque.h"
 #include "param.h"
 #include "stats.h"
+#include "timer.h"
+#include "reclaim.h"
 #include "fibrile.h"
 
 static __thread fibril_t * _restart;
 static __thread fibril_t * _frptr;
+static __thread unsigned _polls;
+static __thread unsigned _fails;
 static deque_t ** _deqs;
 static fibril_t * volatile _stop;
 
+uint64_t fibrili_epoch;
+
+/** Parked frames that have been unparked and wait for a worker. */
+static struct {
+  mutex_t * volatile lock;
+  fibril_t * head;
+  fibril_t * tail;
+} _ready __attribute__((aligned(128)));
+
+/**
+ * With PARAM_IDLE_PARK, a worker that has failed FIBRILI_IDLE_ROUNDS steals
+ * in a row parks on _idle.word for at most PARAM_IDLE_PARK microseconds.
+ * A frame that is made ready wakes up one parked worker, and the shutdown
+ * wakes up all of them, so that neither waits out the timeout. Forks do
+ * not wake anyone, which would cost every fork a load: a successful steal
+ * wakes up one parked worker instead, so that the workers come back one
+ * after another once there is work to share. Work that a lone busy worker
+ * forks, and timers of sleeping fibrils, may still wait until the first
+ * parked worker times out.
+ */
+#define FIBRILI_IDLE_ROUNDS 64
+
+static struct {
+  int volatile word;
+  int volatile parked;
+} _idle __attribute__((aligned(128)));
+
+static void idle_park(void)
+{
+  /** A wakeup after this load changes the word, and the futex won't wait. */
+  int word = fatomic_load(_idle.word);
+
+  fatomic_fadd(_idle.parked, 1);
+
+  if (!fatomic_load(_stop) && !fatomic_load(_ready.head)) {
+    STATS_COUNT(N_PARKS, 1);
+    sync_sleep(&_idle.word, word, PARAM_IDLE_PARK);
+  }
+
+  fatomic_fsub(_idle.parked, 1);
+}
+
+static void idle_wake(int n)
+{
+  fatomic_fadd(_idle.word, 1);
+  if (fatomic_load(_idle.parked)) sync_wake(&_idle.word, n);
+}
+
+/**
+ * Workers from _workers.active on have been retired by
+ * fibril_rt_set_nprocs(). A retired worker runs what is left in its deque,
+ * and then sleeps on _workers.word instead of stealing, until it is
+ * activated again or the runtime stops. Thieves pick their victims among
+ * the first _workers.span workers, which leaves out the retired workers
+ * that are asleep, and so have nothing to steal, from the top down.
+ */
+static struct {
+  mutex_t * volatile lock;
+  int volatile word;
+  int volatile active;
+  int volatile span;
+  char * asleep;
+} _workers __attribute__((aligned(128)));
+
+/** Must hold _workers.lock. */
+static void workers_span(void)
+{
+  int active = _workers.active;
+  int span = _workers.span > active ? _workers.span : active;
+
+  while (span > active && _workers.asleep[span - 1]) span--;
+  fatomic_store(_workers.span, span);
+}
+
+static void workers_sleep(int id, int asleep)
+{
+  mutex_t mutex;
+  mutex_lock(&_workers.lock, &mutex);
+
+  _workers.asleep[id] = asleep;
+  workers_span();
+
+  mutex_unlock(&_workers.lock, &mutex);
+}
+
+static void workers_wake(void)
+{
+  fatomic_fadd(_workers.word, 1);
+  sync_wake(&_workers.word, INT_MAX);
+}
+
+static void workers_retire(int id)
+{
+  DEBUG_DUMP(2, "retire:", (id, "%d"));
+  reclaim_flush();
+  cores_release();
+  workers_sleep(id, 1);
+
+  for (;;) {
+    int word = fatomic_load(_workers.word);
+    if (id < fatomic_load(_workers.active) || fatomic_load(_stop)) break;
+
+    /** Fibrils that sleep in its timer wheel wake up from it alone. */
+    if (timer_pending()) {
+      timer_poll();
+      sched_yield();
+    } else {
+      sync_sleep(&_workers.word, word, 0);
+    }
+  }
+
+  workers_sleep(id, 0);
+  DEBUG_DUMP(2, "activate:", (id, "%d"));
+}
+
+void fibrili_set_nprocs(int n)
+{
+  mutex_t mutex;
+  mutex_lock(&_workers.lock, &mutex);
+
+  fatomic_store(_workers.active, n);
+  workers_span();
+
+  mutex_unlock(&_workers.lock, &mutex);
+  workers_wake();
+}
+
+static void ready_push(fibril_t * frptr)
+{
+  mutex_t mutex;
+  mutex_lock(&_ready.lock, &mutex);
+
+  frptr->next = NULL;
+  if (_ready.tail) _ready.tail->next = frptr;
+  else fatomic_store(_ready.head, frptr);
+  _ready.tail = frptr;
+
+  mutex_unlock(&_ready.lock, &mutex);
+  idle_wake(1);
+}
+
+static fibril_t * ready_pop(void)
+{
+  if (!fatomic_load(_ready.head)) return NULL;
+
+  mutex_t mutex;
+  mutex_lock(&_ready.lock, &mutex);
+
+  fibril_t * frptr = _ready.head;
+  if (frptr) {
+    fatomic_store(_ready.head, frptr->next);
+    if (!frptr->next) _ready.tail = NULL;
+  }
+
+  mutex_unlock(&_ready.lock, &mutex);
+  return frptr;
+}
+
 __attribute__((noreturn)) static
 void longjmp(fibril_t * frptr, void * rsp, uint32_t n)
 {
@@ -65,27 +230,91 @@ void schedule(int id, int nprocs, fibril_t * frptr, uint32_t n)
 
 steal:
   while (!_stop) {
-    long victim;
-    lrand48_r(&_buffer, &victim);
-    victim %= nprocs - 1;
-    if (victim >= id) victim += 1;
+    timer_poll();
 
-    fibril_t * frptr = deque_steal(_deqs[victim]);
+    /**
+     * A parked fibril may leave its parent in our deque. Run it like a
+     * thief first, so that the deque is empty before we resume a frame or
+     * steal from others.
+     */
+    fibril_t * frptr = deque_pop();
 
-    if (frptr) {
-      if (!fibrili_deq.stack) fibrili_deq.stack = pool_take();
+    /** Frames of our own run without a token, but take a free one. */
+    if (frptr) cores_hold();
+
+    if (!frptr && id >= fatomic_load(_workers.active)) {
+      workers_retire(id);
+      continue;
+    }
+
+    if (!frptr && (frptr = ready_pop())) {
+      _fails = 0;
+      cores_hold();
+      DEBUG_DUMP(1, "unpark:", (frptr, "%p"));
+      stack_reinstall(frptr);
+      longjmp(frptr, frptr->stack.top, 0);
+    }
+
+    /**
+     * Under memory pressure, poll the timers and the ready frames 4 or 16
+     * times for every steal, so that suspended work is resumed before new
+     * work takes up more stacks.
+     */
+    int pressure = fatomic_load(reclaim_pressure);
+    int defer = pressure && (++_polls & ((1U << 2 * pressure) - 1));
+
+    if (!frptr && defer) {
+      STATS_COUNT(N_PRESSURED, 1);
+    }
+
+    int span = fatomic_load(_workers.span);
+
+    /** With PARAM_SHARE_CORES, wait for a core rather than steal without. */
+    if (!frptr && !defer && span > 1 && !cores_hold()) {
+      cores_wait();
+      continue;
+    }
+
+    /** Run serially rather than steal beyond PARAM_MAX_STACKS. */
+    if (!frptr && !defer && span > 1 && stack_reserve()) {
+      long victim;
+      lrand48_r(&_buffer, &victim);
+      victim %= span - 1;
+      if (victim >= id) victim += 1;
 
-      DEBUG_DUMP(1, "steal:", (victim, "%d"), (frptr, "%p"));
+      frptr = deque_steal(_deqs[victim]);
+      if (frptr) DEBUG_DUMP(1, "steal:", (victim, "%d"), (frptr, "%p"));
+
+      /** The victim may have more to steal than this worker can take. */
+      if (frptr && fatomic_load(_idle.parked)) idle_wake(1);
+    }
+
+    if (frptr) {
+      _fails = 0;
       STATS_COUNT(N_STEALS, 1);
+      reclaim_mark(frptr->stack.ptr, frptr->stack.top);
       frptr->steals--;
+      fibrili_deq.token = frptr->token.cur;
       longjmp(frptr, stack_setup(frptr), 0);
     }
 
-    /** Force the worker to yield as a penalty for the failed steal. */
-    sched_yield();
+    /** Release held-back stacks while there is nothing else to do. */
+    reclaim_flush();
+
+    /**
+     * Force the worker to yield as a penalty for the failed steal. An idle
+     * worker hands its core back to the other runtimes for a while.
+     */
+    int idle = ++_fails >= FIBRILI_IDLE_ROUNDS;
+
+    if (idle && cores_release()) cores_wait();
+    else if (idle && PARAM_IDLE_PARK) idle_park();
+    else sched_yield();
   }
 
-  sync_barrier(nprocs);
+  reclaim_flush();
+  cores_release();
+  sync_barrier(id, nprocs);
 
   if (id) pthread_exit(NULL);
   else longjmp(_stop, _stop->stack.top, 0);
@@ -99,16 +328,22 @@ void fibrili_init(int id, int nprocs)
   if (id == 0) {
     /** Setup deque pointers. */
     _deqs = malloc(sizeof(deque_t * [nprocs]));
+    _workers.asleep = calloc(nprocs, sizeof(char));
+    _workers.active = nprocs;
+    _workers.span = nprocs;
   }
 
   fibrili_deq.head = 1;
   fibrili_deq.tail = 1;
-  sync_barrier(nprocs);
+  sync_barrier(id, nprocs);
   _deqs[id] = &fibrili_deq;
-  sync_barrier(nprocs);
+  sync_barrier(id, nprocs);
 
   DEBUG_DUMP(2, "proc_start:", (id, "%d"), (_deqs[id], "%p"));
-  sync_barrier(nprocs);
+  sync_barrier(id, nprocs);
+
+  /** The main fibril runs whether or not a core is free. */
+  if (id == 0) cores_hold();
 
   fibril_t fr;
   fibril_init(&fr);
@@ -127,18 +362,26 @@ void fibrili_exit(int id, int nprocs)
   if (id != 0) {
     fibril_init(&fr);
     _stop = &fr;
+    idle_wake(INT_MAX);
+    workers_wake();
     DEBUG_DUMP(2, "proc_stop:", (_stop, "%p"), (fibrili_deq.stack, "%p"));
     fibrili_membar(fibrili_setjmp(_stop));
   } else {
     _stop = &fr;
-    sync_barrier(nprocs);
+    idle_wake(INT_MAX);
+    workers_wake();
+    reclaim_flush();
+    cores_release();
+    sync_barrier(id, nprocs);
   }
 
   free(_deqs);
+  free(_workers.asleep);
 }
 
 void fibrili_resume(fibril_t * frptr, uint32_t n)
 {
+  reclaim_mark(fibrili_deq.stack, __builtin_frame_address(0));
   _frptr = frptr;
   longjmp(_restart, _restart->stack.top, n);
 }
@@ -150,3 +393,35 @@ void fibrili_join(fibril_t * frptr)
   fibrili_resume(frptr, frptr->steals);
 }
 
+void fibrili_unpark(fibril_t * frptr)
+{
+  if (fatomic_subf(frptr->count, 1) == 0) {
+    if (fatomic_swap(frptr->resumable, -1) != 0) {
+      ready_push(frptr);
+    }
+  }
+}
+
+__attribute__((noinline))
+int fibrili_cancelled_slow(struct _fibril_token_t * tk, uint64_t epoch)
+{
+  struct _fibril_token_t * t;
+  int res = 0;
+
+  for (t = tk; t; t = t->parent) {
+    if (fatomic_load(t->cancelled)) {
+      res = 1;
+      break;
+    }
+
+    uint64_t state = fatomic_load_e(t->state, __ATOMIC_RELAXED);
+    if (t != tk && (state >> 1) == epoch) {
+      res = state & 1;
+      break;
+    }
+  }
+
+  fatomic_store_e(tk->state, (epoch << 1) | res, __ATOMIC_RELAXED);
+  return res;
+}
+
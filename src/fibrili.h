@@ -8,6 +8,13 @@
 #define DEQUE_SIZE (1024)
 #endif
 
+struct _fibril_token_t {
+  struct _fibril_token_t * parent;
+  volatile char cancelled;
+  /** Cached result of the ancestor walk: (epoch << 1) | cancelled. */
+  volatile uint64_t state;
+};
+
 struct _fibril_t {
   uint32_t count;
   uint32_t steals;
@@ -17,10 +24,24 @@ struct _fibril_t {
     void * btm;
     void * top;
     void * ptr;
+    /** Stack size that stolen continuations need at most; 0 for any. */
+    uint64_t hint;
   } stack;
+  struct {
+    struct _fibril_token_t * cur;
+    struct _fibril_token_t * prev;
+  } token;
+  struct _fibril_t * next;
   void * pc;
 };
 
+/** A fibril asleep in the timer wheel of a worker. */
+struct _fibrili_timer_t {
+  struct _fibril_t * frptr;
+  uint64_t deadline;
+  struct _fibrili_timer_t * next;
+};
+
 
 #ifdef DEQUE_USE_THE
 extern __thread struct _fibrili_deque_t {
@@ -28,6 +49,7 @@ extern __thread struct _fibrili_deque_t {
   int  head;
   int  tail;
   void * stack;
+  struct _fibril_token_t * token;
   void * buff[DEQUE_SIZE];
 } fibrili_deq;
 
@@ -37,6 +59,7 @@ extern __thread struct _fibrili_deque_t {
   uint64_t head;
   uint64_t tail;
   void * stack;
+  struct _fibril_token_t * token;
   void * buff[DEQUE_SIZE];
 } fibrili_deq;
 #endif
@@ -91,6 +114,25 @@ extern __thread struct _fibrili_deque_t {
 
 __attribute__((noinline)) extern
 void fibrili_join(struct _fibril_t * frptr);
+extern void fibrili_unpark(struct _fibril_t * frptr);
+extern void fibrili_sleep(struct _fibrili_timer_t * tm, uint64_t ns);
+__attribute__((noinline)) extern
+int fibrili_cancelled_slow(struct _fibril_token_t * tk, uint64_t epoch);
+
+/** Bumped by every fibril_cancel() to invalidate cached token states. */
+extern uint64_t fibrili_epoch;
+
+__attribute__((hot)) static inline
+int fibrili_cancelled(struct _fibril_token_t * tk)
+{
+  if (!tk) return 0;
+
+  uint64_t epoch = fatomic_load(fibrili_epoch);
+  uint64_t state = fatomic_load_e(tk->state, __ATOMIC_RELAXED);
+
+  if ((state >> 1) == epoch) return state & 1;
+  return fibrili_cancelled_slow(tk, epoch);
+}
 __attribute__((noreturn)) extern
 void fibrili_resume(struct _fibril_t * frptr, uint32_t n);
 
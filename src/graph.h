@@ -0,0 +1,118 @@
+#ifndef FIBRIL_GRAPH_H
+#define FIBRIL_GRAPH_H
+
+#include <stdlib.h>
+
+/**
+ * Dataflow task graphs on top of fibril_fork/fibril_join.
+ *
+ * A node runs as soon as its last predecessor has finished. The worker that
+ * finishes that predecessor forks the node right away, so the remaining
+ * ready successors become a continuation on its deque that idle workers can
+ * steal. No barrier is placed between nodes other than their edges.
+ */
+typedef struct _fibril_node_t {
+  void (*fn)(void *);
+  void * arg;
+  int deps;   /** Number of unfinished predecessors while running. */
+  int npreds;
+  int nsuccs;
+  int size;
+  struct _fibril_node_t ** succs;
+} fibril_node_t;
+
+/** fibril_node_init. */
+static inline void fibril_node_init(fibril_node_t * nd,
+    void (*fn)(void *), void * arg)
+{
+  nd->fn = fn;
+  nd->arg = arg;
+  nd->deps = 0;
+  nd->npreds = 0;
+  nd->nsuccs = 0;
+  nd->size = 0;
+  nd->succs = NULL;
+}
+
+/**
+ * fibril_node_depend: nd runs only after pred has finished.
+ * @return FIBRIL_FAILURE, leaving both nodes as they were, if the edge
+ * cannot be allocated.
+ */
+static inline int fibril_node_depend(fibril_node_t * nd, fibril_node_t * pred)
+{
+  if (pred->nsuccs == pred->size) {
+    int size = pred->size ? pred->size * 2 : 4;
+    fibril_node_t ** succs = (fibril_node_t **) realloc(pred->succs,
+        sizeof(fibril_node_t *) * size);
+
+    if (!succs) return FIBRIL_FAILURE;
+
+    pred->size = size;
+    pred->succs = succs;
+  }
+
+  pred->succs[pred->nsuccs++] = nd;
+  nd->npreds++;
+  return FIBRIL_SUCCESS;
+}
+
+fibril static __attribute__((noinline, unused))
+void _fibril_node_run(fibril_node_t * nd)
+{
+  nd->fn(nd->arg);
+
+  fibril_t fr;
+  fibril_init(&fr);
+
+  int i;
+  for (i = 0; i < nd->nsuccs; ++i) {
+    fibril_node_t * succ = nd->succs[i];
+
+    if (__atomic_sub_fetch(&succ->deps, 1, __ATOMIC_ACQ_REL) == 0) {
+      fibril_fork(&fr, _fibril_node_run, (succ));
+    }
+  }
+
+  fibril_join(&fr);
+}
+
+/**
+ * fibril_graph_run: execute the n nodes of a graph and wait for all of them.
+ * A graph can be run again once the previous run has returned.
+ */
+fibril static __attribute__((noinline, unused))
+void fibril_graph_run(fibril_node_t * nodes, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    nodes[i].deps = nodes[i].npreds;
+  }
+
+  fibril_t fr;
+  fibril_init(&fr);
+
+  for (i = 0; i < n; ++i) {
+    if (nodes[i].npreds == 0) {
+      fibril_fork(&fr, _fibril_node_run, (&nodes[i]));
+    }
+  }
+
+  fibril_join(&fr);
+}
+
+/** fibril_graph_free: release the edges of the n nodes of a graph. */
+static inline void fibril_graph_free(fibril_node_t * nodes, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    free(nodes[i].succs);
+    nodes[i].succs = NULL;
+    nodes[i].nsuccs = 0;
+    nodes[i].size = 0;
+  }
+}
+
+#endif /* end of include guard: FIBRIL_GRAPH_H */
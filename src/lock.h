@@ -0,0 +1,295 @@
+#ifndef FIBRIL_LOCK_H
+#define FIBRIL_LOCK_H
+
+/**
+ * Blocking synchronization between fibrils.
+ *
+ * fibril_mutex_t is a mutual exclusion lock, fibril_semaphore_t a counting
+ * semaphore and fibril_latch_t a one-shot countdown that releases all of its
+ * waiters once it reaches zero. With the fibril runtime a waiter does not
+ * spin: it parks its continuation and its worker goes on to run other work,
+ * and the releasing fibril hands the continuation back to an idle worker.
+ * None of them is tied to a thread, so a mutex can be released on a
+ * different worker than the one that acquired it.
+ */
+#ifdef FIBRILE_H
+
+typedef struct {
+  char lock;
+  int locked;   /** 0: free, 1: held, 2: held with waiters. */
+  fibril_t * head;
+  fibril_t * tail;
+} fibril_mutex_t;
+
+typedef struct {
+  char lock;
+  long count;
+  fibril_t * head;
+  fibril_t * tail;
+} fibril_semaphore_t;
+
+typedef struct {
+  char lock;
+  long count;
+  fibril_t * head;
+} fibril_latch_t;
+
+#define _fibril_wait_push(q, frptr) do { \
+  (frptr)->next = NULL; \
+  if ((q)->tail) (q)->tail->next = (frptr); \
+  else (q)->head = (frptr); \
+  (q)->tail = (frptr); \
+} while (0)
+
+static inline fibril_t * _fibril_wait_pop(fibril_t ** head, fibril_t ** tail)
+{
+  fibril_t * frptr = *head;
+
+  if (frptr) {
+    *head = frptr->next;
+    if (!*head) *tail = NULL;
+  }
+
+  return frptr;
+}
+
+/** fibril_mutex_init. */
+static inline void fibril_mutex_init(fibril_mutex_t * m)
+{
+  m->lock = 0;
+  m->locked = 0;
+  m->head = NULL;
+  m->tail = NULL;
+}
+
+fibril static __attribute__((noinline, unused))
+void _fibril_mutex_lock_slow(fibril_mutex_t * m)
+{
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibrili_lock(m->lock);
+
+  /** Announce a waiter so that the owner takes the slow unlock path. */
+  if (__atomic_exchange_n(&m->locked, 2, __ATOMIC_ACQUIRE) == 0) {
+    fibrili_unlock(m->lock);
+    return;
+  }
+
+  _fibril_wait_push(m, &fr);
+  fibrili_unlock(m->lock);
+
+  /** The owner hands the mutex over to us when it unparks us. */
+  fibril_park(&fr);
+}
+
+/** fibril_mutex_lock. */
+static inline void fibril_mutex_lock(fibril_mutex_t * m)
+{
+  int free = 0;
+
+  if (!__atomic_compare_exchange_n(&m->locked, &free, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    _fibril_mutex_lock_slow(m);
+  }
+}
+
+/** fibril_mutex_trylock: return 1 if the mutex has been acquired. */
+static inline int fibril_mutex_trylock(fibril_mutex_t * m)
+{
+  int free = 0;
+
+  return __atomic_compare_exchange_n(&m->locked, &free, 1, 0,
+      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/** fibril_mutex_unlock. */
+static inline void fibril_mutex_unlock(fibril_mutex_t * m)
+{
+  int held = 1;
+
+  if (__atomic_compare_exchange_n(&m->locked, &held, 0, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+
+  fibrili_lock(m->lock);
+
+  fibril_t * frptr = _fibril_wait_pop(&m->head, &m->tail);
+
+  if (!frptr) {
+    __atomic_store_n(&m->locked, 0, __ATOMIC_RELEASE);
+  } else if (!m->head) {
+    __atomic_store_n(&m->locked, 1, __ATOMIC_RELEASE);
+  }
+
+  fibrili_unlock(m->lock);
+
+  if (frptr) fibril_unpark(frptr);
+}
+
+/** fibril_semaphore_init. */
+static inline void fibril_semaphore_init(fibril_semaphore_t * s, long count)
+{
+  s->lock = 0;
+  s->count = count;
+  s->head = NULL;
+  s->tail = NULL;
+}
+
+/** fibril_semaphore_wait. */
+fibril static __attribute__((noinline, unused))
+void fibril_semaphore_wait(fibril_semaphore_t * s)
+{
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibrili_lock(s->lock);
+
+  if (s->count > 0) {
+    s->count--;
+    fibrili_unlock(s->lock);
+    return;
+  }
+
+  _fibril_wait_push(s, &fr);
+  fibrili_unlock(s->lock);
+
+  /** The poster passes its unit directly to us. */
+  fibril_park(&fr);
+}
+
+/** fibril_semaphore_post. */
+static inline void fibril_semaphore_post(fibril_semaphore_t * s)
+{
+  fibrili_lock(s->lock);
+
+  fibril_t * frptr = _fibril_wait_pop(&s->head, &s->tail);
+  if (!frptr) s->count++;
+
+  fibrili_unlock(s->lock);
+
+  if (frptr) fibril_unpark(frptr);
+}
+
+/** fibril_latch_init. */
+static inline void fibril_latch_init(fibril_latch_t * l, long count)
+{
+  l->lock = 0;
+  l->count = count;
+  l->head = NULL;
+}
+
+/** fibril_latch_wait: wait until the count of the latch reaches zero. */
+fibril static __attribute__((noinline, unused))
+void fibril_latch_wait(fibril_latch_t * l)
+{
+  if (__atomic_load_n(&l->count, __ATOMIC_ACQUIRE) == 0) return;
+
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibrili_lock(l->lock);
+
+  if (l->count == 0) {
+    fibrili_unlock(l->lock);
+    return;
+  }
+
+  fr.next = l->head;
+  l->head = &fr;
+  fibrili_unlock(l->lock);
+
+  fibril_park(&fr);
+}
+
+/** fibril_latch_count_down: decrease the count and release the waiters. */
+static inline void fibril_latch_count_down(fibril_latch_t * l, long n)
+{
+  fibril_t * frptr = NULL;
+
+  fibrili_lock(l->lock);
+
+  if ((l->count -= n) <= 0) {
+    l->count = 0;
+    frptr = l->head;
+    l->head = NULL;
+  }
+
+  fibrili_unlock(l->lock);
+
+  while (frptr) {
+    fibril_t * next = frptr->next;
+    fibril_unpark(frptr);
+    frptr = next;
+  }
+}
+
+#else
+
+#include <pthread.h>
+
+/**
+ * Other backends have no way to suspend a task, so they fall back to
+ * blocking the calling thread.
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  long count;
+} _fibril_lock_t;
+
+typedef _fibril_lock_t fibril_mutex_t;
+typedef _fibril_lock_t fibril_semaphore_t;
+typedef _fibril_lock_t fibril_latch_t;
+
+static inline void _fibril_lock_init(_fibril_lock_t * l, long count)
+{
+  pthread_mutex_init(&l->mutex, NULL);
+  pthread_cond_init(&l->cond, NULL);
+  l->count = count;
+}
+
+#define fibril_mutex_init(m) _fibril_lock_init(m, 0)
+#define fibril_mutex_lock(m) pthread_mutex_lock(&(m)->mutex)
+#define fibril_mutex_trylock(m) (pthread_mutex_trylock(&(m)->mutex) == 0)
+#define fibril_mutex_unlock(m) pthread_mutex_unlock(&(m)->mutex)
+
+#define fibril_semaphore_init(s, n) _fibril_lock_init(s, n)
+
+static inline void fibril_semaphore_wait(fibril_semaphore_t * s)
+{
+  pthread_mutex_lock(&s->mutex);
+  while (s->count == 0) pthread_cond_wait(&s->cond, &s->mutex);
+  s->count--;
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static inline void fibril_semaphore_post(fibril_semaphore_t * s)
+{
+  pthread_mutex_lock(&s->mutex);
+  s->count++;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+#define fibril_latch_init(l, n) _fibril_lock_init(l, n)
+
+static inline void fibril_latch_wait(fibril_latch_t * l)
+{
+  pthread_mutex_lock(&l->mutex);
+  while (l->count > 0) pthread_cond_wait(&l->cond, &l->mutex);
+  pthread_mutex_unlock(&l->mutex);
+}
+
+static inline void fibril_latch_count_down(fibril_latch_t * l, long n)
+{
+  pthread_mutex_lock(&l->mutex);
+  if ((l->count -= n) <= 0) {
+    l->count = 0;
+    pthread_cond_broadcast(&l->cond);
+  }
+  pthread_mutex_unlock(&l->mutex);
+}
+
+#endif
+
+#endif /* end of include guard: FIBRIL_LOCK_H */
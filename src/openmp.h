@@ -4,6 +4,7 @@
 #include <omp.h>
 #include <thread>
 #include <functional>
+#include <time.h>
 
 #define _fibril_expand(...) \
   _fibril_expand_(_fibril_nth(__VA_ARGS__), ## __VA_ARGS__)
@@ -77,6 +78,19 @@ inline static void fibril_join(__attribute__((unused)) fibril_t *f) {
 #pragma omp taskwait
 }
 
+#define fibril_token_t __attribute__((unused)) int
+#define fibril_token_init(fp, tk) ((void) (fp), (void) (tk))
+#define fibril_cancel(tk) ((void) (tk))
+#define fibril_cancelled() (0)
+#define fibril_stack_hint(fp, size) ((void) (fp), (void) (size))
+#define fibril_rt_prealloc(n) ((void) (n))
+#define fibril_rt_set_nprocs(n) ((void) (n))
+#define fibril_sleep_ns(ns) do { \
+  struct timespec _ts = { (time_t) ((ns) / 1000000000), \
+    (long) ((ns) % 1000000000) }; \
+  nanosleep(&_ts, NULL); \
+} while (0)
+
 #define fibril_fork_nrt(fp, fn, ag) _omp_fork_nrt(fn, _fibril_expand ag)
 #define fibril_fork_wrt(fp, rtp, fn, ag) _omp_fork_wrt(fn, rtp, _fibril_expand ag)
 
@@ -1,14 +1,34 @@
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include "safe.h"
 #include "param.h"
 
 size_t PARAM_PAGE_SIZE;
 void * PARAM_STACK_ADDR;
+size_t PARAM_MAIN_STACK_SIZE;
 size_t PARAM_STACK_SIZE;
+size_t PARAM_STACK_GROW;
 int PARAM_NPROCS;
+int PARAM_HUGE_PAGES;
+int PARAM_MEMFD_STACKS;
+int PARAM_PAGE_STATS;
+int PARAM_RECLAIM;
+size_t PARAM_RESIDENT_BUDGET;
+unsigned long PARAM_RECLAIM_PERIOD;
+unsigned long PARAM_IDLE_PARK;
+int PARAM_PREALLOC_STACKS;
+int PARAM_NUMA_NODES;
+int PARAM_STACK_AFFINITY;
+size_t PARAM_MAX_STACKS;
+char * PARAM_PRESSURE_FILE;
+char * PARAM_SHARE_CORES;
+double PARAM_PRESSURE_SOME;
+double PARAM_PRESSURE_FULL;
 
 static size_t get_page_size()
 {
@@ -24,6 +44,146 @@ static void get_stack_size(void ** addr, size_t * size)
   pthread_attr_getstack(&attr, addr, size);
 }
 
+/**
+ * Read a size in bytes from the environment variable name, with an optional
+ * K, M or G suffix, or return size if it is not set.
+ */
+static size_t param_size(const char * name, size_t size)
+{
+  char * env = getenv(name);
+
+  if (env) {
+    char * end;
+    size_t n = strtoul(env, &end, 0);
+
+    switch (*end) {
+      case 'g': case 'G': n <<= 10; /* fall through */
+      case 'm': case 'M': n <<= 10; /* fall through */
+      case 'k': case 'K': n <<= 10;
+    }
+
+    if (n > 0 || end != env) size = n;
+  }
+
+  return size;
+}
+
+/**
+ * Size of a continuation stack: FIBRIL_STACK_SIZE bytes rounded up to whole
+ * pages; 1 MiB by default.
+ */
+static size_t param_stack_size()
+{
+  size_t size = param_size("FIBRIL_STACK_SIZE", 0x100000);
+
+  if (size == 0) size = 0x100000;
+  if (size < (size_t) PTHREAD_STACK_MIN) size = PTHREAD_STACK_MIN;
+  return (size + PARAM_PAGE_SIZE - 1) & ~(PARAM_PAGE_SIZE - 1);
+}
+
+/**
+ * FIBRIL_HUGE_PAGES=thp backs stacks with transparent huge pages and
+ * FIBRIL_HUGE_PAGES=hugetlb with preallocated ones; unset means no huge
+ * pages.
+ */
+static int param_huge_pages()
+{
+  char * env = getenv("FIBRIL_HUGE_PAGES");
+
+  if (!env) return PARAM_HUGE_NONE;
+  if (strcmp(env, "thp") == 0) return PARAM_HUGE_THP;
+  if (strcmp(env, "hugetlb") == 0) return PARAM_HUGE_TLB;
+
+  return PARAM_HUGE_NONE;
+}
+
+/**
+ * FIBRIL_RECLAIM selects how the pages of unused stacks are given back:
+ * none, free (MADV_FREE), dontneed (MADV_DONTNEED) or deferred. The default
+ * is free when built with FIBRIL_USE_MADVISE and none otherwise.
+ */
+static int param_reclaim()
+{
+  char * env = getenv("FIBRIL_RECLAIM");
+
+#ifdef FIBRIL_USE_MADVISE
+  int reclaim = PARAM_RECLAIM_FREE;
+#else
+  int reclaim = PARAM_RECLAIM_NONE;
+#endif
+
+  if (!env) return reclaim;
+  if (strcmp(env, "none") == 0) return PARAM_RECLAIM_NONE;
+  if (strcmp(env, "free") == 0) return PARAM_RECLAIM_FREE;
+  if (strcmp(env, "dontneed") == 0) return PARAM_RECLAIM_DONTNEED;
+  if (strcmp(env, "deferred") == 0) return PARAM_RECLAIM_DEFERRED;
+
+  return reclaim;
+}
+
+/**
+ * Number of NUMA nodes: one more than the highest node that is online, or 1
+ * if the system does not say. FIBRIL_NUMA=off pretends there is one node
+ * and FIBRIL_NUMA=n that there are n.
+ */
+static int param_numa_nodes()
+{
+  char * env = getenv("FIBRIL_NUMA");
+
+  if (env && strcmp(env, "off") == 0) return 1;
+  if (env && atoi(env) > 0) return atoi(env);
+
+  FILE * file = fopen("/sys/devices/system/node/online", "r");
+  if (!file) return 1;
+
+  int nodes = 0;
+  int node;
+
+  while (fscanf(file, "%d", &node) == 1) {
+    if (node + 1 > nodes) nodes = node + 1;
+    if (fgetc(file) == EOF) break;
+  }
+
+  fclose(file);
+  return nodes > 0 ? nodes : 1;
+}
+
+/**
+ * The PSI file that reports the memory pressure on the process, or NULL if
+ * the monitor is off, which is the default. FIBRIL_PRESSURE=on picks the
+ * memory.pressure file of the cgroup of the process and falls back to
+ * /proc/pressure/memory; any other value but off names the file to read,
+ * which may as well be a synthetic one.
+ */
+static char * param_pressure_file()
+{
+  static char path[PATH_MAX];
+  char * env = getenv("FIBRIL_PRESSURE");
+
+  if (!env || strcmp(env, "off") == 0) return NULL;
+  if (strcmp(env, "on") != 0) return env;
+
+  /** A cgroup v2 entry reads 0::/path. */
+  FILE * file = fopen("/proc/self/cgroup", "r");
+  char line[PATH_MAX];
+
+  while (file && fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "0::", 3) != 0) continue;
+
+    line[strcspn(line, "\n")] = '\0';
+    int len = snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.pressure",
+        line + 3);
+    if (len > 0 && len < (int) sizeof(path) && access(path, R_OK) == 0) break;
+    path[0] = '\0';
+  }
+
+  if (file) fclose(file);
+  if (path[0]) return path;
+
+  return access("/proc/pressure/memory", R_OK) == 0 ?
+    "/proc/pressure/memory" : NULL;
+}
+
 int param_nprocs(int n) {
   int nprocs = 0;
 
@@ -55,11 +215,98 @@ void param_init(int n)
   PARAM_PAGE_SIZE = get_page_size();
   DEBUG_DUMP(2, "init:", (PARAM_PAGE_SIZE, "0x%lx"));
 
-  get_stack_size(&PARAM_STACK_ADDR, &PARAM_STACK_SIZE);
-  PARAM_STACK_SIZE = 0x100000;
+  get_stack_size(&PARAM_STACK_ADDR, &PARAM_MAIN_STACK_SIZE);
   DEBUG_DUMP(2, "init:", (PARAM_STACK_ADDR, "%p"));
+  DEBUG_DUMP(2, "init:", (PARAM_MAIN_STACK_SIZE, "0x%lx"));
+
+  PARAM_STACK_SIZE = param_stack_size();
   DEBUG_DUMP(2, "init:", (PARAM_STACK_SIZE, "0x%lx"));
 
+  /** FIBRIL_STACK_GROW=size starts stacks with size bytes; 0 means off. */
+  PARAM_STACK_GROW = param_size("FIBRIL_STACK_GROW", 0);
+  PARAM_STACK_GROW = (PARAM_STACK_GROW + PARAM_PAGE_SIZE - 1) &
+    ~(PARAM_PAGE_SIZE - 1);
+  DEBUG_DUMP(2, "init:", (PARAM_STACK_GROW, "0x%lx"));
+
+  PARAM_HUGE_PAGES = param_huge_pages();
+  DEBUG_DUMP(2, "init:", (PARAM_HUGE_PAGES, "%d"));
+
+  /** FIBRIL_MEMFD_STACKS=1 backs the arena with a memfd (experimental). */
+  char * env = getenv("FIBRIL_MEMFD_STACKS");
+  PARAM_MEMFD_STACKS = env ? atoi(env) != 0 : 0;
+  DEBUG_DUMP(2, "init:", (PARAM_MEMFD_STACKS, "%d"));
+
+  /**
+   * FIBRIL_PAGE_STATS=mincore has FIBRIL_STATS sample resident pages with
+   * mincore() instead of counting the first touch of every page with a
+   * fault; fault is the default.
+   */
+  env = getenv("FIBRIL_PAGE_STATS");
+  PARAM_PAGE_STATS = env && strcmp(env, "mincore") == 0 ?
+    PARAM_PAGE_STATS_MINCORE : PARAM_PAGE_STATS_FAULT;
+  DEBUG_DUMP(2, "init:", (PARAM_PAGE_STATS, "%d"));
+
+  PARAM_RECLAIM = param_reclaim();
+  PARAM_RESIDENT_BUDGET = param_size("FIBRIL_RESIDENT_BUDGET", 0);
+  DEBUG_DUMP(2, "init:", (PARAM_RECLAIM, "%d"),
+      (PARAM_RESIDENT_BUDGET, "0x%lx"));
+
+  /** FIBRIL_RECLAIM_PERIOD=ms starts the background reclaimer. */
+  env = getenv("FIBRIL_RECLAIM_PERIOD");
+  PARAM_RECLAIM_PERIOD = env ? strtoul(env, NULL, 0) : 0;
+  DEBUG_DUMP(2, "init:", (PARAM_RECLAIM_PERIOD, "%lu"));
+
+  /**
+   * FIBRIL_IDLE_PARK=us parks idle workers for up to us; 0 means off. New
+   * forks of a lone busy worker may wait that long for a thief.
+   */
+  env = getenv("FIBRIL_IDLE_PARK");
+  PARAM_IDLE_PARK = env ? strtoul(env, NULL, 0) : 0;
+  DEBUG_DUMP(2, "init:", (PARAM_IDLE_PARK, "%lu"));
+
+  /** FIBRIL_PREALLOC_STACKS=n has every worker start with n stacks. */
+  env = getenv("FIBRIL_PREALLOC_STACKS");
+  PARAM_PREALLOC_STACKS = env ? atoi(env) : 0;
+  if (PARAM_PREALLOC_STACKS < 0) PARAM_PREALLOC_STACKS = 0;
+  DEBUG_DUMP(2, "init:", (PARAM_PREALLOC_STACKS, "%d"));
+
+  PARAM_NUMA_NODES = param_numa_nodes();
+  DEBUG_DUMP(2, "init:", (PARAM_NUMA_NODES, "%d"));
+
+  /** FIBRIL_STACK_AFFINITY=1 returns stacks to the worker that took them. */
+  env = getenv("FIBRIL_STACK_AFFINITY");
+  PARAM_STACK_AFFINITY = env ? atoi(env) != 0 : 0;
+  DEBUG_DUMP(2, "init:", (PARAM_STACK_AFFINITY, "%d"));
+
+  /**
+   * FIBRIL_MAX_STACKS=n caps the live stacks, of every class, that steals
+   * can take; 0 means no cap. Steals then run on full-sized stacks only.
+   * Resumed frames may still go beyond the cap.
+   */
+  env = getenv("FIBRIL_MAX_STACKS");
+  PARAM_MAX_STACKS = env ? strtoul(env, NULL, 0) : 0;
+  DEBUG_DUMP(2, "init:", (PARAM_MAX_STACKS, "%lu"));
+
+  /**
+   * FIBRIL_PRESSURE_SOME and FIBRIL_PRESSURE_FULL are the percentages of
+   * time over 10 seconds that some or all tasks stall on memory, above
+   * which the runtime backs off.
+   */
+  PARAM_PRESSURE_FILE = param_pressure_file();
+  env = getenv("FIBRIL_PRESSURE_SOME");
+  PARAM_PRESSURE_SOME = env ? strtod(env, NULL) : 10.0;
+  env = getenv("FIBRIL_PRESSURE_FULL");
+  PARAM_PRESSURE_FULL = env ? strtod(env, NULL) : 5.0;
+  DEBUG_DUMP(2, "init:", (PARAM_PRESSURE_FILE, "%s"),
+      (PARAM_PRESSURE_SOME, "%g"), (PARAM_PRESSURE_FULL, "%g"));
+
+  /**
+   * FIBRIL_SHARE_CORES=name shares the cores with the other runtimes that
+   * name the same shared memory segment.
+   */
+  PARAM_SHARE_CORES = getenv("FIBRIL_SHARE_CORES");
+  DEBUG_DUMP(2, "init:", (PARAM_SHARE_CORES, "%s"));
+
   PARAM_NPROCS = param_nprocs(n);
   DEBUG_DUMP(2, "init:", (PARAM_NPROCS, "%d"));
 }
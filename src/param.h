@@ -5,8 +5,41 @@
 
 extern size_t PARAM_PAGE_SIZE;
 extern void * PARAM_STACK_ADDR;
+extern size_t PARAM_MAIN_STACK_SIZE;
 extern size_t PARAM_STACK_SIZE;
+extern size_t PARAM_STACK_GROW;
 extern int PARAM_NPROCS;
+extern int PARAM_HUGE_PAGES;
+extern int PARAM_MEMFD_STACKS;
+extern int PARAM_PAGE_STATS;
+
+/** Backing of the stack arena, from FIBRIL_HUGE_PAGES. */
+#define PARAM_HUGE_NONE 0
+#define PARAM_HUGE_THP 1
+#define PARAM_HUGE_TLB 2
+
+extern int PARAM_RECLAIM;
+extern size_t PARAM_RESIDENT_BUDGET;
+extern unsigned long PARAM_RECLAIM_PERIOD;
+extern unsigned long PARAM_IDLE_PARK;
+extern int PARAM_PREALLOC_STACKS;
+extern int PARAM_NUMA_NODES;
+extern int PARAM_STACK_AFFINITY;
+extern size_t PARAM_MAX_STACKS;
+extern char * PARAM_PRESSURE_FILE;
+extern char * PARAM_SHARE_CORES;
+extern double PARAM_PRESSURE_SOME;
+extern double PARAM_PRESSURE_FULL;
+
+/** How FIBRIL_STATS counts stack pages, from FIBRIL_PAGE_STATS. */
+#define PARAM_PAGE_STATS_FAULT 0
+#define PARAM_PAGE_STATS_MINCORE 1
+
+/** Reclamation policy for stack pages, from FIBRIL_RECLAIM. */
+#define PARAM_RECLAIM_NONE 0
+#define PARAM_RECLAIM_FREE 1
+#define PARAM_RECLAIM_DONTNEED 2
+#define PARAM_RECLAIM_DEFERRED 3
 
 #define PAGE_ALIGN_DOWN(x) ((void *) ((size_t) (x) & ~(PARAM_PAGE_SIZE - 1)))
 #define PAGE_ALIGNED(x) (0 == ((size_t) (x) & (PARAM_PAGE_SIZE - 1)))
@@ -0,0 +1,182 @@
+#ifndef FIBRIL_PIPELINE_H
+#define FIBRIL_PIPELINE_H
+
+#include <stdlib.h>
+
+/**
+ * Pipeline parallelism in the style of Cilk-P.
+ *
+ * Every iteration of a pipeline passes an item through a sequence of
+ * stages. The first stage is serial and produces the item of a new
+ * iteration each time it is called with NULL, until it returns NULL. Every
+ * later stage maps the item of its iteration to the item of the next stage.
+ * A serial stage runs one iteration at a time in iteration order, while a
+ * parallel stage runs concurrently for all iterations that reach it. At most
+ * limit iterations are in flight at a time, which caps the number of live
+ * items.
+ */
+#define FIBRIL_STAGE_PARALLEL 0
+#define FIBRIL_STAGE_SERIAL 1
+
+typedef struct {
+  void * (*fn)(void * arg, void * item);
+  int serial;
+} fibril_stage_t;
+
+typedef struct {
+  const fibril_stage_t * stages;
+  int nstages;
+  int limit;
+  void * arg;
+  /** done[s]: number of iterations that have finished serial stage s. */
+  long * done;
+  struct {
+    int busy;
+    void * waiter;
+  } * slots;
+  void * control;
+} _fibril_pipe_t;
+
+#define _fibril_pipe_slot(p, i) (&(p)->slots[(i) % (p)->limit])
+
+#ifdef FIBRILE_H
+
+/**
+ * Park the calling fibril until cond holds. Whoever makes cond true wakes
+ * the fibril published in waiter; spurious wakeups just check cond again.
+ */
+#define _fibril_pipe_wait(waiter, cond) do { \
+  while (!(cond)) { \
+    fibril_t _fr; \
+    fibril_init(&_fr); \
+    __atomic_store_n(&(waiter), (void *) &_fr, __ATOMIC_SEQ_CST); \
+    if ((cond)) { \
+      void * _self = &_fr; \
+      if (__atomic_compare_exchange_n(&(waiter), &_self, NULL, 0, \
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) break; \
+    } \
+    fibril_park(&_fr); \
+  } \
+} while (0)
+
+#define _fibril_pipe_wake(waiter) do { \
+  fibril_t * _fr = (fibril_t *) __atomic_exchange_n(&(waiter), NULL, \
+      __ATOMIC_SEQ_CST); \
+  if (_fr) fibril_unpark(_fr); \
+} while (0)
+
+fibril static __attribute__((noinline, unused))
+void _fibril_pipe_iter(_fibril_pipe_t * p, long i,
+    void * item)
+{
+  int s;
+
+  for (s = 1; s < p->nstages; ++s) {
+    if (p->stages[s].serial) {
+      _fibril_pipe_wait(_fibril_pipe_slot(p, i)->waiter,
+          __atomic_load_n(&p->done[s], __ATOMIC_SEQ_CST) >= i);
+
+      item = p->stages[s].fn(p->arg, item);
+
+      __atomic_store_n(&p->done[s], i + 1, __ATOMIC_SEQ_CST);
+      _fibril_pipe_wake(_fibril_pipe_slot(p, i + 1)->waiter);
+    } else {
+      item = p->stages[s].fn(p->arg, item);
+    }
+  }
+
+  __atomic_store_n(&_fibril_pipe_slot(p, i)->busy, 0, __ATOMIC_SEQ_CST);
+  _fibril_pipe_wake(p->control);
+}
+
+/** fibril_pipeline. */
+fibril static __attribute__((noinline, unused))
+void fibril_pipeline(const fibril_stage_t * stages,
+    int nstages, int limit, void * arg)
+{
+  _fibril_pipe_t p;
+  long i;
+
+  p.stages = stages;
+  p.nstages = nstages;
+  p.limit = limit > 0 ? limit : 1;
+  p.arg = arg;
+  p.done = (long *) calloc(nstages, sizeof(long));
+  p.slots = (__typeof__(p.slots)) calloc(p.limit, sizeof(p.slots[0]));
+  p.control = NULL;
+
+  fibril_t fr;
+  fibril_init(&fr);
+
+  for (i = 0; ; ++i) {
+    /** Throttle: the slot of iteration i - limit must be free again. */
+    _fibril_pipe_wait(p.control,
+        !__atomic_load_n(&_fibril_pipe_slot(&p, i)->busy, __ATOMIC_SEQ_CST));
+
+    void * item = stages[0].fn(arg, NULL);
+    if (!item) break;
+
+    _fibril_pipe_slot(&p, i)->busy = 1;
+    fibril_fork(&fr, _fibril_pipe_iter, (&p, i, item));
+  }
+
+  fibril_join(&fr);
+
+  free(p.done);
+  free(p.slots);
+}
+
+#else
+
+/**
+ * Backends without suspension run the pipeline in batches of limit
+ * iterations, one stage at a time, so that no stage ever has to wait.
+ */
+fibril static __attribute__((noinline, unused))
+void _fibril_pipe_stage(_fibril_pipe_t * p, int s,
+    void ** item)
+{
+  *item = p->stages[s].fn(p->arg, *item);
+}
+
+fibril static __attribute__((noinline, unused))
+void fibril_pipeline(const fibril_stage_t * stages,
+    int nstages, int limit, void * arg)
+{
+  _fibril_pipe_t p;
+  int i, n, s;
+
+  p.stages = stages;
+  p.nstages = nstages;
+  p.limit = limit > 0 ? limit : 1;
+  p.arg = arg;
+
+  void ** items = (void **) malloc(sizeof(void *) * p.limit);
+
+  do {
+    for (n = 0; n < p.limit; ++n) {
+      if (!(items[n] = stages[0].fn(arg, NULL))) break;
+    }
+
+    for (s = 1; s < nstages; ++s) {
+      if (stages[s].serial) {
+        for (i = 0; i < n; ++i) _fibril_pipe_stage(&p, s, &items[i]);
+      } else {
+        fibril_t fr;
+        fibril_init(&fr);
+
+        for (i = 0; i < n; ++i) {
+          fibril_fork(&fr, _fibril_pipe_stage, (&p, s, &items[i]));
+        }
+
+        fibril_join(&fr);
+      }
+    }
+  } while (n == p.limit);
+
+  free(items);
+}
+
+#endif
+
+#endif /* end of include guard: FIBRIL_PIPELINE_H */
@@ -1,18 +1,33 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include "safe.h"
 #include "sync.h"
 #include "mutex.h"
 #include "param.h"
 #include "stats.h"
 #include "pool.h"
+#include "reclaim.h"
 
-#ifndef POOL_GLOBAL_SIZE
-#define POOL_GLOBAL_SIZE (2048 - 3)
+#ifndef POOL_MAGAZINE_SIZE
+#define POOL_MAGAZINE_SIZE 4
 #endif
 
-#define POOL_LOCAL_COUNT 8
-#define POOL_LOCAL_SIZE ((256 / POOL_LOCAL_COUNT) - 3)
+#ifndef POOL_DEPOT_SIZE
+#define POOL_DEPOT_SIZE 2048
+#endif
+
+/** Depots of the large stacks; nodes beyond the last share them. */
+#ifndef POOL_DEPOT_COUNT
+#define POOL_DEPOT_COUNT 8
+#endif
+
+#define POOL_NUMA (PARAM_NUMA_NODES > 1)
 
 #ifndef POOL_PRIVATE_SIZE
 #define POOL_PRIVATE_SIZE 7
@@ -22,361 +37,985 @@
 #define POOL_CACHE_SIZE 4
 #endif
 
+/** Pages at the top of a preallocated stack that are faulted in. */
+#ifndef POOL_PREFAULT_PAGES
+#define POOL_PREFAULT_PAGES 4
+#endif
 
 
-static inline void *pool_alloc()
-{
-  void *stack;
 
-  SAFE_RZCALL(posix_memalign(&stack, PARAM_PAGE_SIZE, PARAM_STACK_SIZE));
-  STATS_INC(N_STACKS, 1);
-#ifdef FIBRIL_STATS
-  SAFE_NNCALL(mprotect(stack, PARAM_STACK_SIZE, PROT_NONE));
+/**
+ * All stacks are carved from one arena of POOL_ARENA_SIZE bytes that is
+ * reserved at startup without committing memory. The arena is split into
+ * one region per stack class, and a stack is allocated by bumping the
+ * pointer of its region, so both pool_contains() and the class of a stack
+ * are range checks. Stacks that the pools give up are kept on a free list
+ * per class for pool_alloc(). The whole arena is unmapped at exit. If the
+ * arena cannot be reserved or a region runs out, stacks come from the heap
+ * and are full-sized.
+ *
+ * Every stack is preceded by POOL_GUARD_SIZE bytes of inaccessible memory,
+ * protected once when the stack is created, so that an overflow faults
+ * instead of running into the memory below. Pools and free lists never
+ * touch the guard.
+ *
+ * With FIBRIL_HUGE_PAGES set, the arena is backed by huge pages, either
+ * transparent ones (MADV_HUGEPAGE) or a hugetlbfs mapping of
+ * POOL_HUGETLB_SIZE bytes (MAP_HUGETLB) that falls back to transparent huge
+ * pages if the system has too few of them. Regions are then aligned to huge
+ * pages and stacks are packed without guards, since a guard would split its
+ * huge page, so the tops of neighboring stacks share a TLB entry.
+ *
+ * With FIBRIL_MEMFD_STACKS set and no huge pages, the arena is a shared
+ * mapping of a memfd instead, so the pages of all stacks are the pages of
+ * one file. Released pages are punched out of the file, which frees them
+ * at once whatever the advice, and the file shows exactly how much memory
+ * the stacks hold. This is experimental: a child of fork() shares the
+ * stacks with its parent.
+ */
+#ifndef POOL_ARENA_SIZE
+#define POOL_ARENA_SIZE (1UL << 36)
 #endif
 
-  return stack;
+#ifndef POOL_HUGETLB_SIZE
+#define POOL_HUGETLB_SIZE (1UL << 30)
+#endif
+
+#define POOL_HUGE_PAGE_SIZE (2UL << 20)
+#define POOL_GUARD_SIZE PARAM_PAGE_SIZE
+
+static struct {
+  void * base;
+  size_t size;
+  size_t region_size;
+  size_t guard;
+  void * map;
+  size_t map_size;
+  int fd;
+  struct {
+    size_t volatile used;
+    mutex_t * volatile lock;
+    void * volatile free;
+  } region[POOL_CLASSES] __attribute__((aligned(128)));
+} _arena = { .fd = -1 };
+
+#define POOL_REGION_SIZE (_arena.region_size)
+
+/**
+ * Dropping or protecting part of a huge page would split it (or fail with
+ * hugetlb), so stacks keep their pages while the arena uses huge pages.
+ */
+#define POOL_SMALL_PAGES (PARAM_HUGE_PAGES == PARAM_HUGE_NONE)
+
+/**
+ * With PARAM_STACK_GROW, a stack of the arena starts out with only its top
+ * PARAM_STACK_GROW bytes accessible, besides its first page, which holds
+ * the links of the pools. A fault below that part makes pool_grow() open
+ * up at least twice as much, and the stack is shrunk back, its grown pages
+ * released, when the pool hands it out again. How far it has grown is
+ * kept in the slot below the depth mark of reclaim.c, which reads 0 once
+ * the pages of the stack have all been released, so the stack is closed
+ * back down to PARAM_STACK_GROW before they are. Stacks from
+ * the heap, and stacks in builds that count pages by faults, are fixed.
+ * A system call that writes below the grown part fails with EFAULT
+ * instead of faulting, so fibrils that pass large buffers on their stacks
+ * to the kernel need a larger PARAM_STACK_GROW.
+ */
+#define POOL_GROW (PARAM_STACK_GROW && POOL_SMALL_PAGES && !STATS_FAULTS)
+
+static inline size_t * grown_of(void * stack)
+{
+  return (size_t *) (stack + pool_stack_size(stack)) - 2;
 }
 
-static inline void pool_free(void *stack)
+/** Close what a growable stack has grown beyond PARAM_STACK_GROW. */
+static inline void pool_close(void * stack)
 {
-  free(stack);
-  STATS_DEC(N_STACKS, 1);
+  if (!POOL_GROW || !pool_contains(stack)) return;
+
+  size_t * grown = grown_of(stack);
+  if (*grown <= PARAM_STACK_GROW) return;
+
+  SAFE_NNCALL(mprotect(stack + pool_stack_size(stack) - *grown,
+        *grown - PARAM_STACK_GROW, PROT_NONE));
+  *grown = 0;
 }
 
+static void remote_init(void);
+static void remote_exit(void);
+
+void pool_init()
+{
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  size_t align = PARAM_PAGE_SIZE;
+  size_t size = POOL_ARENA_SIZE;
+  void * map = MAP_FAILED;
+
+  if (PARAM_HUGE_PAGES == PARAM_HUGE_TLB) {
+    /** Reserve the huge pages now rather than SIGBUS on first touch. */
+    size = POOL_HUGETLB_SIZE;
+    map = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+        -1, 0);
+
+    if (map == MAP_FAILED) {
+      DEBUG_DUMP(1, "pool_init: no hugetlb pages:", (size, "0x%lx"));
+      PARAM_HUGE_PAGES = PARAM_HUGE_THP;
+      size = POOL_ARENA_SIZE;
+    }
+  }
 
+  if (PARAM_HUGE_PAGES != PARAM_HUGE_NONE) align = POOL_HUGE_PAGE_SIZE;
 
-#ifdef POOL_WAIT_FREE
+  if (PARAM_MEMFD_STACKS && PARAM_HUGE_PAGES == PARAM_HUGE_NONE) {
+    int fd = memfd_create("fibril-stacks", MFD_CLOEXEC);
 
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+      map = mmap(NULL, size, prot, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    }
 
-static __thread struct {
-  volatile size_t pos;
-  void *buf[POOL_PRIVATE_SIZE];
-} _pp __attribute__((aligned(128)));
+    if (map != MAP_FAILED) {
+      _arena.fd = fd;
+    } else {
+      DEBUG_DUMP(1, "pool_init: no memfd:", (fd, "%d"));
+      if (fd >= 0) close(fd);
+    }
+  }
 
-typedef struct stack {
-  struct stack *next;
-} stack_t;
+  PARAM_MEMFD_STACKS = _arena.fd >= 0;
 
-#ifdef POOL_LOCAL_POOLS
-typedef struct stackptr {
-  stack_t *top;
-} __attribute__((aligned(128))) stackptr_t;
+  if (map == MAP_FAILED) {
+    size += align - PARAM_PAGE_SIZE;
+    map = mmap(NULL, size, prot, flags, -1, 0);
 
-stackptr_t _pl[POOL_LOCAL_COUNT];
-#endif
+    if (map == MAP_FAILED) {
+      DEBUG_DUMP(1, "pool_init:", (size, "0x%lx"));
+      return;
+    }
+  }
 
-//static stack_t *_pg __attribute__((aligned(128)));
-//static stack_t *_heap __attribute__((aligned(128)));
-static stack_t *_pg;
-static stack_t *_heap;
+  _arena.map = map;
+  _arena.map_size = size;
+  _arena.base = (void *) (((size_t) map + align - 1) & ~(align - 1));
+  _arena.size = (map + size - _arena.base) & ~(align - 1);
+  _arena.region_size = (_arena.size / POOL_CLASSES) & ~(align - 1);
+  _arena.guard = PARAM_HUGE_PAGES == PARAM_HUGE_NONE ? POOL_GUARD_SIZE : 0;
 
+  if (PARAM_HUGE_PAGES == PARAM_HUGE_THP) {
+    SAFE_NNCALL(madvise(_arena.base, _arena.size, MADV_HUGEPAGE));
+  }
 
-#define ADDRESS_BITS 48
-#define AVAILABLE_MASK (PARAM_PAGE_SIZE - 1)
-#define ADDRESS_MASK (((1UL << ADDRESS_BITS) - 1) & (~AVAILABLE_MASK))
+  int cls;
+  for (cls = 0; cls < POOL_CLASSES; ++cls) {
+    _arena.region[cls].used = 0;
+    _arena.region[cls].free = NULL;
+  }
 
-static inline stack_t *fold_pointer(stack_t *p, uint16_t c, uint16_t a)
+  DEBUG_DUMP(2, "pool_init:", (_arena.base, "%p"), (_arena.size, "0x%lx"),
+      (PARAM_HUGE_PAGES, "%d"));
+
+  remote_init();
+}
+
+int pool_contains(void * addr)
+{
+  return addr >= _arena.base && addr < _arena.base + _arena.size;
+}
+
+/**
+ * Class c is a quarter of the size of class c - 1, but no smaller than
+ * POOL_MIN_STACK_SIZE. Class 0 is the full PARAM_STACK_SIZE.
+ */
+static inline size_t class_size(int cls)
 {
-  SAFE_ASSERT(a <= AVAILABLE_MASK);
-  return (stack_t*) ((uintptr_t) p | ((uintptr_t) c << ADDRESS_BITS) | (uintptr_t) a);
+  size_t size = PARAM_STACK_SIZE >> (2 * cls);
+  size_t min = POOL_MIN_STACK_SIZE;
+
+  if (min > PARAM_STACK_SIZE) min = PARAM_STACK_SIZE;
+  return size < min ? min : size;
 }
 
-static inline uint16_t unfold_counter(stack_t *p)
+int pool_class(size_t size)
 {
-  return (size_t) ((uintptr_t) p >> ADDRESS_BITS);
+  int cls = 0;
+
+  if (size == 0) return 0;
+
+  while (cls + 1 < POOL_CLASSES && class_size(cls + 1) >= size) cls++;
+  return cls;
 }
 
-static inline uint16_t unfold_available(stack_t *p)
+int pool_stack_class(void * stack)
 {
-  return (size_t) ((uintptr_t) p & AVAILABLE_MASK);
+  if (!pool_contains(stack)) return 0;
+  return (stack - _arena.base) / POOL_REGION_SIZE;
 }
 
-static inline stack_t *unfold_pointer(stack_t *p)
+size_t pool_stack_size(void * stack)
 {
-  return (stack_t*) ((uintptr_t) p & ADDRESS_MASK);
+  if (stack == PARAM_STACK_ADDR) return PARAM_MAIN_STACK_SIZE;
+  return class_size(pool_stack_class(stack));
 }
 
-#undef ADDRESS_BITS
-#undef AVAILABLE_MASK
-#undef ADDRESS_MASK
+static void * arena_pop(int cls)
+{
+  void * stack = NULL;
 
+  if (fatomic_load(_arena.region[cls].free)) {
+    mutex_t mutex;
+    mutex_lock(&_arena.region[cls].lock, &mutex);
 
-static inline void* treiber_stack_pop(stack_t **top) {
-  stack_t *stack;
-  stack_t *next;
-  stack_t *head;
+    if ((stack = _arena.region[cls].free)) {
+      _arena.region[cls].free = *(void **) stack;
+    }
 
-  head = fatomic_load(*top);
-  do {
-    stack = unfold_pointer(head);
-    if (!stack)
-      return NULL;
-    next = fold_pointer(fatomic_load(stack->next), unfold_counter(head) + 1, unfold_available(head) - 1);
-  } while (!fatomic_cas_e(*top, head, next, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    mutex_unlock(&_arena.region[cls].lock, &mutex);
+  }
 
   return stack;
 }
 
-static inline int treiber_stack_push(
-    stack_t **top,
-    stack_t *chunk,
-    stack_t *tail,
-    size_t pool_size,
-    size_t chunk_size
-    ) {
-  size_t available;
-  stack_t *next;
-  stack_t *head;
+static void arena_push(void * stack)
+{
+  int cls = pool_stack_class(stack);
 
-  available = 0;
-  head = fatomic_load(*top);
-  do {
-    fatomic_store_e(tail->next, unfold_pointer(head), __ATOMIC_RELAXED);
-    available = unfold_available(head) + chunk_size;
-    if (pool_size && available > pool_size)
-      return 0;
-    next = fold_pointer(chunk, unfold_counter(head) + 1, available);
-  } while (!fatomic_cas_e(*top, head, next, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  mutex_t mutex;
+  mutex_lock(&_arena.region[cls].lock, &mutex);
 
-  return 1;
+  *(void **) stack = _arena.region[cls].free;
+  _arena.region[cls].free = stack;
+
+  mutex_unlock(&_arena.region[cls].lock, &mutex);
 }
 
-static inline int treiber_stack_swap(
-    stack_t **top,
-    stack_t **chunk,
-    stack_t **tail,
-    size_t pool_size,
-    size_t *chunk_size
-    ) {
-  stack_t *next;
-  stack_t *head;
+/** The depot of the node that the calling worker runs on. */
+static inline int pool_node(void)
+{
+  unsigned int cpu, node;
 
-  if (pool_size && *chunk_size > pool_size)
-    return 0;
+  if (getcpu(&cpu, &node) != 0) return 0;
+  return node % POOL_DEPOT_COUNT;
+}
 
-  head = fatomic_load(*top);
-#if 1
-  do {
-    next = fold_pointer(*chunk, unfold_counter(head) + 1, *chunk_size);
-  } while (!fatomic_cas_e(*top, head, next, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
-#else
-  next = fold_pointer(*chunk, unfold_counter(head) + 1, *chunk_size);
-  head = fatomic_swap(*top, next);
-#endif
+/**
+ * Have the pages of a stack that the calling worker is about to use be
+ * faulted in on its node, wherever the stack was used before. Pages that
+ * are still resident stay where they are.
+ */
+static inline void pool_place(void * stack, size_t size)
+{
+  unsigned int cpu, node;
 
-  *chunk = unfold_pointer(head);
-  *chunk_size = unfold_available(head);
-  for (*tail = *chunk; *tail && (*tail)->next; *tail = (*tail)->next) { }
+  if (!POOL_NUMA || !POOL_SMALL_PAGES) return;
+  if (getcpu(&cpu, &node) != 0 || node >= 8 * sizeof(unsigned long)) return;
 
-  return 1;
+  unsigned long mask = 1UL << node;
+
+  if (syscall(SYS_mbind, stack, size, MPOL_PREFERRED, &mask,
+        8 * sizeof(mask) + 1, 0) != 0) {
+    DEBUG_DUMP(1, "pool_place:", (stack, "%p"), (node, "%u"));
+  }
 }
 
-void *pool_take()
+/**
+ * Stacks of every class that have been allocated and not given back to the
+ * arena or the heap, pooled or not. With PARAM_MAX_STACKS, pool_try_take()
+ * and pool_try_alloc() never add to them beyond it, and every steal runs on
+ * the full-sized stack that stack_reserve() took that way. Only a frame
+ * that is resumed from the ready list or the deque of its worker may find
+ * the worker without a stack, and it takes one of its class, cap or not.
+ */
+static size_t volatile _live;
+
+static inline void *pool_make(int cls)
 {
-  void *stack = NULL;
+  void *stack = arena_pop(cls);
 
-  if (_pp.pos > 0) {
-    stack = _pp.buf[--_pp.pos];
-    goto POOL_TAKE_SAFE_RETURN;
+  if (!stack && _arena.size) {
+    size_t size = _arena.guard + class_size(cls);
+    size_t offset = fatomic_fadd(_arena.region[cls].used, size);
+
+    if (offset + size <= POOL_REGION_SIZE) {
+      stack = _arena.base + cls * POOL_REGION_SIZE + offset;
+      if (_arena.guard) {
+        SAFE_NNCALL(mprotect(stack, _arena.guard, PROT_NONE));
+      }
+      stack += _arena.guard;
+
+      if (POOL_GROW &&
+          class_size(cls) > PARAM_STACK_GROW + PARAM_PAGE_SIZE) {
+        SAFE_NNCALL(mprotect(stack + PARAM_PAGE_SIZE, class_size(cls) -
+              PARAM_STACK_GROW - PARAM_PAGE_SIZE, PROT_NONE));
+      }
+    }
+  }
+
+  if (!stack) {
+    SAFE_RZCALL(posix_memalign(&stack, PARAM_PAGE_SIZE,
+          POOL_GUARD_SIZE + PARAM_STACK_SIZE));
+    SAFE_NNCALL(mprotect(stack, POOL_GUARD_SIZE, PROT_NONE));
+    stack += POOL_GUARD_SIZE;
   }
 
-#ifdef POOL_LOCAL_POOLS
-  int idx = _tid / (256 / POOL_LOCAL_COUNT);
-  stack = treiber_stack_pop(&(_pl[idx].top));
-  if (stack)
-    goto POOL_TAKE_SAFE_RETURN;
+  pool_place(stack, class_size(cls));
+
+  STATS_INC(N_STACKS, 1);
+#ifdef FIBRIL_STATS
+  /** The first page holds the links of the pools and is not counted. */
+  if (STATS_FAULTS && (POOL_SMALL_PAGES || !pool_contains(stack))) {
+    SAFE_NNCALL(mprotect(stack + PARAM_PAGE_SIZE,
+          pool_stack_size(stack) - PARAM_PAGE_SIZE, PROT_NONE));
+  }
 #endif
 
-  stack = treiber_stack_pop(&_pg);
-  if (stack)
-    goto POOL_TAKE_SAFE_RETURN;
+  return stack;
+}
+
+static inline void * pool_alloc(int cls)
+{
+  fatomic_fadd(_live, 1);
+  return pool_make(cls);
+}
 
-  stack = treiber_stack_pop(&_heap);
-  if (stack)
-    goto POOL_TAKE_SAFE_RETURN;
+/** Allocate a full-sized stack unless PARAM_MAX_STACKS are live. */
+static inline void * pool_try_alloc(void)
+{
+  size_t live = fatomic_load(_live);
 
-  stack = pool_alloc();
+  /** Under full memory pressure, steals only run on pooled stacks. */
+  if (fatomic_load(reclaim_pressure) == RECLAIM_PRESSURE_FULL) return NULL;
+  if (!PARAM_MAX_STACKS) return pool_alloc(0);
+
+  do {
+    if (live >= PARAM_MAX_STACKS) return NULL;
+  } while (!fatomic_cas(_live, live, live + 1));
+
+  return pool_make(0);
+}
+
+/** Give a stack that is not part of the arena back to the heap. */
+static inline void pool_release(void *stack)
+{
+  void * addr = stack - POOL_GUARD_SIZE;
+
+  SAFE_NNCALL(mprotect(addr, POOL_GUARD_SIZE + PARAM_STACK_SIZE,
+        PROT_READ | PROT_WRITE));
+  free(addr);
+}
+
+static inline void pool_free(void *stack)
+{
+  STATS_DEC(N_STACKS, 1);
+  fatomic_fsub(_live, 1);
+
+  if (!pool_contains(stack)) {
+    pool_release(stack);
+    return;
+  }
+
+  pool_close(stack);
+  reclaim_stack(stack, stack, pool_stack_size(stack), MADV_DONTNEED,
+      arena_push);
+}
+
+/** Stacks taken from beyond the private pools since pool_demand(). */
+static size_t volatile _demand;
+
+#define POOL_DEMAND(n) do { \
+  if (PARAM_RECLAIM_PERIOD) fatomic_fadd(_demand, n); \
+} while (0)
+
+size_t pool_demand(void)
+{
+  return fatomic_swap(_demand, 0);
+}
+
+/**
+ * Stacks of the smaller classes are cached per worker, and the free list
+ * of their region serves as the shared pool behind the caches.
+ */
+static __thread struct {
+  size_t avail;
+  void * buff[POOL_PRIVATE_SIZE];
+} _pc[POOL_CLASSES];
+
+/**
+ * Open up the stack that addr falls into down to at least addr, if it is a
+ * growable stack that has not grown that far; called on a fault.
+ * @return Return 0 if the fault is not for a growable stack to handle.
+ */
+int pool_grow(void * addr)
+{
+  if (!POOL_GROW || !pool_contains(addr)) return 0;
+
+  int cls = pool_stack_class(addr);
+  size_t size = class_size(cls);
+  size_t slot = _arena.guard + size;
+  void * region = _arena.base + cls * POOL_REGION_SIZE;
+  void * stack = region + (addr - region) / slot * slot + _arena.guard;
+  void * top = stack + size;
+  void * page = PAGE_ALIGN_DOWN(addr);
+
+  size_t * grown = grown_of(stack);
+  size_t have = *grown > PARAM_STACK_GROW ? *grown : PARAM_STACK_GROW;
+  size_t want = 2 * have;
+
+  /** Faults in the guard or the first page are not for us. */
+  if (page < stack + PARAM_PAGE_SIZE || page >= top - have) return 0;
+
+  while (want < (size_t) (top - page)) want *= 2;
+  if (want > size - PARAM_PAGE_SIZE) want = size - PARAM_PAGE_SIZE;
+
+  SAFE_NNCALL(mprotect(top - want, want - have, PROT_READ | PROT_WRITE));
+  *grown = want;
+
+  STATS_COUNT(N_GROWS, 1);
+  return 1;
+}
+
+/** Take back what a growable stack has grown beyond PARAM_STACK_GROW. */
+static inline void * pool_shrink(void * stack)
+{
+  if (!POOL_GROW || !pool_contains(stack)) return stack;
+
+  size_t * grown = grown_of(stack);
+  if (*grown <= PARAM_STACK_GROW) return stack;
+
+  void * low = stack + pool_stack_size(stack) - *grown;
+  size_t len = *grown - PARAM_STACK_GROW;
+
+  if (!pool_punch(low, len)) SAFE_NNCALL(madvise(low, len, MADV_DONTNEED));
+  pool_close(stack);
 
-POOL_TAKE_SAFE_RETURN:
-  SAFE_ASSERT(stack);
   return stack;
 }
 
-void pool_put(void *stack)
+static void * pool_take_small(int cls)
 {
-  SAFE_ASSERT(stack);
+  if (_pc[cls].avail > 0) {
+    return pool_shrink(_pc[cls].buff[--_pc[cls].avail]);
+  }
 
-  while (_pp.pos >= POOL_PRIVATE_SIZE) {
-    stack_t *chunk = _pp.buf[--_pp.pos];
-    stack_t *tail = chunk;
-    size_t chunk_size = 1;
-    while (_pp.pos > POOL_CACHE_SIZE) {
-      fatomic_store_e(tail->next, _pp.buf[--_pp.pos], __ATOMIC_RELAXED);
-      tail = tail->next;
-      chunk_size++;
+  void * stack = arena_pop(cls);
+  return stack ? pool_shrink(stack) : pool_alloc(cls);
+}
+
+static void pool_put_small(void * stack)
+{
+  int cls = pool_stack_class(stack);
+
+  if (_pc[cls].avail >= POOL_PRIVATE_SIZE) {
+    /** Keep only POOL_CACHE_SIZE stacks. */
+    while (_pc[cls].avail > POOL_CACHE_SIZE) {
+      arena_push(_pc[cls].buff[--_pc[cls].avail]);
     }
+  }
 
-#ifdef POOL_LOCAL_POOLS
-    int idx = _tid / (256 / POOL_LOCAL_COUNT);
-    if (treiber_stack_push(&(_pl[idx].top), chunk, tail, POOL_LOCAL_SIZE, chunk_size))
-      break;
-    tail->next = NULL;
-    treiber_stack_swap(&(_pl[idx].top), &chunk, &tail, POOL_LOCAL_SIZE, &chunk_size);
-    if (!chunk_size)
-      break;
-#endif
+  _pc[cls].buff[_pc[cls].avail++] = stack;
+}
 
-    if (treiber_stack_push(&_pg, chunk, tail, POOL_GLOBAL_SIZE, chunk_size))
-      break;
+static void pool_clear();
+
+/** Drop every pooled stack and release the arena in one go. */
+void pool_exit()
+{
+  pool_clear();
+  remote_exit();
+  _live = 0;
 
-    tail->next = NULL;
-    for (stack_t *current = chunk; current != NULL; current = current->next) {
-      void *addr = (void*) ((char*) current + PARAM_PAGE_SIZE);
-      SAFE_NNCALL(madvise(addr, PARAM_STACK_SIZE - PARAM_PAGE_SIZE, MADV_FREE));
+  int cls;
+  for (cls = 0; cls < POOL_CLASSES; ++cls) _pc[cls].avail = 0;
+
+  if (_arena.size) {
+    /** Without faults to count, the pages still held are counted here. */
+    for (cls = 0; !STATS_FAULTS && cls < POOL_CLASSES; ++cls) {
+      size_t used = _arena.region[cls].used;
+      if (used > POOL_REGION_SIZE) used = POOL_REGION_SIZE;
+
+      STATS_COUNT(N_PAGES, stats_mincore(_arena.base + cls * POOL_REGION_SIZE,
+            used));
     }
 
-    treiber_stack_push(&_heap, chunk, tail, 0, 0);
+    SAFE_NNCALL(munmap(_arena.map, _arena.map_size));
+    _arena.base = NULL;
+    _arena.size = 0;
   }
 
-  /** Invariant: we always put stack into private pool. */
-  _pp.buf[_pp.pos++] = stack;
+  if (_arena.fd >= 0) {
+    close(_arena.fd);
+    _arena.fd = -1;
+  }
 }
 
-#else
+/**
+ * Free the pages of [addr, addr + size) by punching them out of the memfd
+ * that backs the arena.
+ * @return Return 0 if the range is not backed by the memfd.
+ */
+int pool_punch(void * addr, size_t size)
+{
+  if (_arena.fd < 0 || !pool_contains(addr)) return 0;
+
+  SAFE_NNCALL(fallocate(_arena.fd, FALLOC_FL_PUNCH_HOLE |
+        FALLOC_FL_KEEP_SIZE, addr - _arena.map, size));
+  return 1;
+}
 
 
+/**
+ * Full-sized stacks are pooled in magazines of POOL_MAGAZINE_SIZE stacks,
+ * after Bonwick and Adams. Every worker takes and puts stacks on a loaded
+ * and a previous magazine of its own without synchronization. Only when
+ * both are empty, or both are full, does it go to a depot, where it trades
+ * a whole magazine for a full or an empty one with a single CAS on a list
+ * of magazines, so moving stacks between the tiers costs the same however
+ * many move at once.
+ *
+ * Every NUMA node has a depot of its own that the workers running on it go
+ * to; on a single node only the first one is used. A worker takes a
+ * magazine from the depot of another node, whose stacks were faulted in
+ * over there, only before it would allocate a new stack. A depot holds at
+ * most POOL_DEPOT_SIZE stacks, and the stacks of a full magazine that does
+ * not fit go back to the arena.
+ *
+ * The lists of a depot are Treiber stacks with a tag in the high bits of
+ * their head against ABA. Magazines are only freed by pool_exit(), so the
+ * next pointer of a magazine that is popped by someone else in between is
+ * safe to read.
+ */
+typedef struct magazine {
+  struct magazine * next;
+  struct magazine * all;
+  int rounds;
+  void * stack[POOL_MAGAZINE_SIZE];
+} magazine_t;
+
 static struct {
-  mutex_t * volatile lock;
+  magazine_t * full;
+  magazine_t * empty;
   size_t volatile avail;
-  void * buff[POOL_GLOBAL_SIZE];
-} _pg __attribute__((aligned(128)));
+} __attribute__((aligned(128))) _depot[POOL_DEPOT_COUNT];
 
-#ifdef POOL_LOCAL_POOLS
-struct {
-  mutex_t * volatile lock;
-  size_t volatile avail;
-  void * buff[POOL_LOCAL_SIZE];
-} __attribute__((aligned(128))) _pl[POOL_LOCAL_COUNT];
-#endif
+/** Every magazine there is, for pool_clear(). */
+static magazine_t * _magazines;
 
-static __thread struct {
-  size_t volatile avail;
-  void * buff[POOL_PRIVATE_SIZE];
-} _pp __attribute__((aligned(128)));
+static __thread magazine_t * _loaded;
+static __thread magazine_t * _previous;
+
+#define MAGAZINE_TAG_SHIFT 48
+#define MAGAZINE_PTR_MASK ((1UL << MAGAZINE_TAG_SHIFT) - 1)
+
+static inline magazine_t * magazine_pop(magazine_t ** list)
+{
+  magazine_t * head = fatomic_load(*list);
+  magazine_t * mag;
+  magazine_t * next;
+
+  do {
+    mag = (magazine_t *) ((uintptr_t) head & MAGAZINE_PTR_MASK);
+    if (!mag) return NULL;
+
+    next = (magazine_t *) ((uintptr_t) fatomic_load(mag->next) |
+        (((uintptr_t) head >> MAGAZINE_TAG_SHIFT) + 1) << MAGAZINE_TAG_SHIFT);
+  } while (!fatomic_cas_e(*list, head, next, __ATOMIC_ACQUIRE,
+        __ATOMIC_ACQUIRE));
+
+  return mag;
+}
+
+static inline void magazine_push(magazine_t ** list, magazine_t * mag)
+{
+  magazine_t * head = fatomic_load(*list);
+  magazine_t * next;
+
+  do {
+    fatomic_store_e(mag->next,
+        (magazine_t *) ((uintptr_t) head & MAGAZINE_PTR_MASK),
+        __ATOMIC_RELAXED);
+    next = (magazine_t *) ((uintptr_t) mag |
+        (((uintptr_t) head >> MAGAZINE_TAG_SHIFT) + 1) << MAGAZINE_TAG_SHIFT);
+  } while (!fatomic_cas_e(*list, head, next, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED));
+}
+
+/** Take an empty magazine from the depot of node, or make one. */
+static magazine_t * magazine_empty(int node)
+{
+  magazine_t * mag = magazine_pop(&_depot[node].empty);
+  if (mag) return mag;
+
+  SAFE_NZCALL(mag = malloc(sizeof(magazine_t)));
+  mag->rounds = 0;
+  mag->all = fatomic_load(_magazines);
+  while (!fatomic_cas(_magazines, mag->all, mag));
+
+  return mag;
+}
+
+/** Take a full magazine from the depot of node. */
+static magazine_t * depot_take(int node)
+{
+  magazine_t * mag = magazine_pop(&_depot[node].full);
+  if (mag) fatomic_fsub(_depot[node].avail, mag->rounds);
+  return mag;
+}
+
+/** Put a full magazine into the depot of node unless it is full. */
+static int depot_put(int node, magazine_t * mag)
+{
+  size_t avail = fatomic_fadd(_depot[node].avail, mag->rounds);
+
+  if (avail + mag->rounds > POOL_DEPOT_SIZE) {
+    fatomic_fsub(_depot[node].avail, mag->rounds);
+    return 0;
+  }
+
+  magazine_push(&_depot[node].full, mag);
+  return 1;
+}
 
 /**
- * Take a stack from the pool or allocate from heap if the pool is empty.
- * @return Return a stack or NULL if the pool has reached its limit.
+ * Forget all pooled stacks and magazines. The other workers must have
+ * exited.
  */
-void * pool_take()
+static void pool_clear()
 {
-  void * stack = NULL;
+  magazine_t * mag = fatomic_swap(_magazines, NULL);
 
-  /** Take a stack from the available stacks. */
-  if (_pp.avail > 0) {
-    stack = _pp.buff[--_pp.avail];
-    goto POOL_TAKE_SAFE_RETURN;
+  while (mag) {
+    magazine_t * all = mag->all;
+    int i;
+
+    for (i = 0; i < mag->rounds; ++i) {
+      if (!pool_contains(mag->stack[i])) pool_release(mag->stack[i]);
+    }
+
+    free(mag);
+    mag = all;
   }
 
-  /** Take a stack from the parent pool. */
-#ifdef POOL_LOCAL_POOLS
-  //int idx = _tid % POOL_LOCAL_COUNT;
-  int idx = _tid / (256 / POOL_LOCAL_COUNT);
+  int node;
+  for (node = 0; node < POOL_DEPOT_COUNT; ++node) {
+    _depot[node].full = NULL;
+    _depot[node].empty = NULL;
+    _depot[node].avail = 0;
+  }
 
-  if (_pl[idx].avail > 0) {
-    mutex_t mutex;
-    mutex_lock(&_pl[idx].lock, &mutex);
+  _loaded = NULL;
+  _previous = NULL;
+}
+
+/**
+ * Pop a stack from the depots if they hold more than keep. Stacks are
+ * given out a whole magazine at a time, so this may go below keep by less
+ * than a magazine.
+ */
+static __thread magazine_t * _trimmed;
+
+static void * pool_shared_pop(size_t keep)
+{
+  while (!_trimmed || _trimmed->rounds == 0) {
+    if (_trimmed) magazine_push(&_depot[0].empty, _trimmed);
+    _trimmed = NULL;
+
+    size_t avail = 0;
+    int node;
+
+    for (node = 0; node < POOL_DEPOT_COUNT; ++node) {
+      avail += fatomic_load(_depot[node].avail);
+    }
+
+    if (avail <= keep) return NULL;
 
-    if (_pl[idx].avail > 0) {
-      stack = _pl[idx].buff[--_pl[idx].avail];
-      mutex_unlock(&_pl[idx].lock, &mutex);
-      goto POOL_TAKE_SAFE_RETURN;
+    for (node = 0; !_trimmed && node < POOL_DEPOT_COUNT; ++node) {
+      _trimmed = depot_take(node);
     }
 
-    mutex_unlock(&_pl[idx].lock, &mutex);
+    if (!_trimmed) return NULL;
   }
-#endif
 
-  if (_pg.avail > 0) {
-    mutex_t mutex;
-    mutex_lock(&_pg.lock, &mutex);
+  return _trimmed->stack[--_trimmed->rounds];
+}
 
-    if (_pg.avail > 0) {
-      stack = _pg.buff[--_pg.avail];
-      mutex_unlock(&_pg.lock, &mutex);
-      goto POOL_TAKE_SAFE_RETURN;
+/**
+ * Take a stack from the magazines, or allocate one if they are empty and
+ * either capped is 0 or the cap allows it.
+ */
+static void * magazine_take(int capped)
+{
+  magazine_t * mag;
+
+  if (_loaded && _loaded->rounds > 0) {
+    return _loaded->stack[--_loaded->rounds];
+  }
+
+  if (_previous && _previous->rounds > 0) {
+    mag = _loaded;
+    _loaded = _previous;
+    _previous = mag;
+    return _loaded->stack[--_loaded->rounds];
+  }
+
+  /** Both magazines are empty: trade one for a full one. */
+  int node = POOL_NUMA ? pool_node() : 0;
+  int i;
+
+  mag = depot_take(node);
+
+  /** Rather take stacks of another node than allocate a new one. */
+  for (i = 1; !mag && POOL_NUMA && i < POOL_DEPOT_COUNT; ++i) {
+    mag = depot_take((node + i) % POOL_DEPOT_COUNT);
+    if (mag) {
+      STATS_COUNT(N_REMOTE_STACKS, mag->rounds);
     }
+  }
 
-    mutex_unlock(&_pg.lock, &mutex);
+  if (!mag) {
+    POOL_DEMAND(1);
+    return capped ? pool_try_alloc() : pool_alloc(0);
   }
 
-  stack = pool_alloc();
+  POOL_DEMAND(mag->rounds);
 
-POOL_TAKE_SAFE_RETURN:
-  SAFE_ASSERT(stack);
-  return stack;
+  if (_previous) magazine_push(&_depot[node].empty, _previous);
+  _previous = _loaded;
+  _loaded = mag;
+
+  return _loaded->stack[--_loaded->rounds];
 }
 
 /**
- * Put a stack back into pool.
- * @param p The pool to put back into.
+ * Put a stack back into the magazines.
  * @param stack The stack to put back.
  */
-void pool_put(void * stack)
+static void magazine_put(void * stack)
 {
   SAFE_ASSERT(stack);
 
-  /** If local pool does not have space, */
-  if (_pp.avail >= POOL_PRIVATE_SIZE) {
-    /** Try moving stacks to parent pool. */
-#ifdef POOL_LOCAL_POOLS
-    int idx = _tid / (256 / POOL_LOCAL_COUNT);
+  magazine_t * mag;
 
-    mutex_t mutex;
-    mutex_lock(&_pl[idx].lock, &mutex);
+  if (_loaded && _loaded->rounds < POOL_MAGAZINE_SIZE) {
+    _loaded->stack[_loaded->rounds++] = stack;
+    return;
+  }
 
-    if (_pl[idx].avail >= POOL_LOCAL_SIZE - POOL_CACHE_SIZE && _pg.avail < POOL_GLOBAL_SIZE) {
-      mutex_t mutex;
-      mutex_lock(&_pg.lock, &mutex);
+  if (_previous && _previous->rounds < POOL_MAGAZINE_SIZE) {
+    mag = _loaded;
+    _loaded = _previous;
+    _previous = mag;
+    _loaded->stack[_loaded->rounds++] = stack;
+    return;
+  }
 
-      /** Keep only POOL_LOCAL_SIZE / 2 stacks. */
-      while (_pl[idx].avail > (POOL_LOCAL_SIZE / 2) && _pg.avail < POOL_GLOBAL_SIZE) {
-        _pg.buff[_pg.avail++] = _pl[idx].buff[--_pl[idx].avail];
-      }
+  /** Both magazines are full: trade one for an empty one. */
+  int node = POOL_NUMA ? pool_node() : 0;
 
-      mutex_unlock(&_pg.lock, &mutex);
+  if (_previous && (fatomic_load(reclaim_pressure) ||
+        !depot_put(node, _previous))) {
+    /** The depot is full or memory is short: back to the arena. */
+    while (_previous->rounds > 0) {
+      pool_free(_previous->stack[--_previous->rounds]);
     }
 
-    /** Keep only POOL_CACHE_SIZE stacks. */
-    while (_pp.avail > POOL_CACHE_SIZE && _pl[idx].avail < POOL_LOCAL_SIZE) {
-      _pl[idx].buff[_pl[idx].avail++] = _pp.buff[--_pp.avail];
-    }
+    mag = _previous;
+  } else {
+    mag = magazine_empty(node);
+  }
 
-    mutex_unlock(&_pl[idx].lock, &mutex);
+  _previous = _loaded;
+  _loaded = mag;
+  _loaded->stack[_loaded->rounds++] = stack;
+}
 
-#else
+/**
+ * With PARAM_STACK_AFFINITY, every full-sized stack of the arena remembers
+ * the worker that took it from the pool last, on whose node its pages were
+ * faulted in. A stack that another worker puts back goes onto the remote
+ * free list of that worker, linked through its first word, and the worker
+ * moves the stacks on its list into its own magazines the next time it
+ * takes a stack. Pushing is a CAS, and the owner takes the whole list with
+ * one swap.
+ *
+ * A worker puts back the stack that it still runs on when it resumes a
+ * frame, so a stack that goes to another worker is held in _leaving until
+ * the next call of the worker into the pool, when it has left the stack.
+ */
+static int * _home;
+static __thread void * _leaving;
 
-    if (_pg.avail < POOL_GLOBAL_SIZE) {
-      mutex_t mutex;
-      mutex_lock(&_pg.lock, &mutex);
+static struct remote {
+  void * volatile head;
+} __attribute__((aligned(128))) * _remote;
 
-      /** Keep only POOL_CACHE_SIZE stacks. */
-      while (_pp.avail > POOL_CACHE_SIZE && _pg.avail < POOL_GLOBAL_SIZE) {
-        _pg.buff[_pg.avail++] = _pp.buff[--_pp.avail];
-      }
+/** The worker that owns stack plus one, or NULL if it has no owner. */
+static inline int * home_of(void * stack)
+{
+  if (!pool_contains(stack) || pool_stack_class(stack) != 0) return NULL;
+  return &_home[(stack - _arena.base) / (_arena.guard + class_size(0))];
+}
 
-      mutex_unlock(&_pg.lock, &mutex);
-    }
-#endif
+static void remote_init(void)
+{
+  if (!PARAM_STACK_AFFINITY || !_arena.size) return;
+
+  size_t slots = POOL_REGION_SIZE / (_arena.guard + class_size(0)) + 1;
+
+  SAFE_NZCALL(_home = calloc(slots, sizeof(int)));
+  SAFE_RZCALL(posix_memalign((void **) &_remote, sizeof(struct remote),
+        sizeof(struct remote) * PARAM_NPROCS));
+
+  int i;
+  for (i = 0; i < PARAM_NPROCS; ++i) _remote[i].head = NULL;
+}
+
+static void remote_exit(void)
+{
+  free(_home);
+  free(_remote);
+  _home = NULL;
+  _remote = NULL;
+  _leaving = NULL;
+}
+
+static void remote_push(int id, void * stack)
+{
+  void * head = fatomic_load(_remote[id].head);
+
+  do {
+    *(void **) stack = head;
+  } while (!fatomic_cas(_remote[id].head, head, stack));
+
+  STATS_COUNT(N_REMOTE_FREES, 1);
+}
+
+static void remote_leave(void * stack)
+{
+  if (_leaving) remote_push(*home_of(_leaving) - 1, _leaving);
+  _leaving = stack;
+}
+
+static void remote_drain(void)
+{
+  void * stack = fatomic_swap(_remote[_tid].head, NULL);
+
+  while (stack) {
+    void * next = *(void **) stack;
+    magazine_put(stack);
+    stack = next;
+  }
+}
+
+static void * pool_take_large(int capped)
+{
+  if (!_remote) {
+    void * stack = magazine_take(capped);
+    return stack ? pool_shrink(stack) : NULL;
+  }
+
+  if (_leaving) remote_leave(NULL);
+  if (fatomic_load(_remote[_tid].head)) remote_drain();
+
+  void * stack = magazine_take(capped);
+  int * home = home_of(stack);
+
+  if (home) *home = _tid + 1;
+  return stack ? pool_shrink(stack) : NULL;
+}
+
+/**
+ * Take a stack from the pool or allocate one if the pool is empty.
+ */
+void * pool_take()
+{
+  return pool_take_large(0);
+}
+
+/**
+ * Take a full-sized stack from the pool, or allocate one if the pool is
+ * empty and fewer than PARAM_MAX_STACKS stacks are live.
+ * @return Return a stack or NULL if the cap has been reached.
+ */
+void * pool_try_take()
+{
+  return pool_take_large(1);
+}
 
-    /** Free local pool for space. */
-    while (_pp.avail >= POOL_PRIVATE_SIZE) {
-      pool_free(_pp.buff[--_pp.avail]);
+/**
+ * Put a stack back into the pool.
+ * @param stack The stack to put back.
+ */
+static void pool_put_large(void * stack)
+{
+  int * home = _remote ? home_of(stack) : NULL;
+
+  if (_leaving) remote_leave(NULL);
+
+  if (home && *home && *home - 1 != _tid) remote_leave(stack);
+  else magazine_put(stack);
+}
+
+void * pool_take_class(int cls)
+{
+  return cls == 0 ? pool_take() : pool_take_small(cls);
+}
+
+void pool_put(void * stack)
+{
+  if (pool_stack_class(stack) == 0) pool_put_large(stack);
+  else pool_put_small(stack);
+}
+
+/**
+ * Give up the stacks of the shared pools beyond keep. Their pages are
+ * released in one batch, and they go back to the arena or the heap.
+ * @return The number of stacks given up.
+ */
+size_t pool_trim(size_t keep)
+{
+  size_t n = 0;
+  void * stack;
+
+  while ((stack = pool_shared_pop(keep))) {
+    STATS_DEC(N_STACKS, 1);
+    STATS_COUNT(N_TRIMMED, 1);
+    fatomic_fsub(_live, 1);
+
+    if (pool_contains(stack)) {
+      pool_close(stack);
+      reclaim_batch(stack, stack, pool_stack_size(stack), MADV_DONTNEED,
+          arena_push);
+    } else {
+      pool_release(stack);
     }
+
+    n++;
   }
 
-  /** Invariant: we always put stack into private pool. */
-  _pp.buff[_pp.avail++] = stack;
+  reclaim_flush();
+  return n;
 }
 
-#endif
+/**
+ * Allocate n full-sized stacks, fault in the top POOL_PREFAULT_PAGES pages
+ * of each and put them into the pools of the calling worker, so that the
+ * first steals do not pay for it. FIBRIL_STATS counts the pages that stacks
+ * touch by faulting on them, unless it samples them with mincore(), so it
+ * leaves them alone then.
+ */
+void pool_prealloc(int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    void * stack = pool_try_alloc();
+    if (!stack) break;
+
+    void * top = stack + pool_stack_size(stack);
+    void * addr = top - POOL_PREFAULT_PAGES * PARAM_PAGE_SIZE;
+
+    if (addr < stack || STATS_FAULTS) addr = top;
+    for (; addr < top; addr += PARAM_PAGE_SIZE) *(volatile char *) addr = 0;
+
+    pool_put(stack);
+  }
+}
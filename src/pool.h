@@ -1,14 +1,35 @@
 #ifndef POOL_H
 #define POOL_H
 
+#include <stddef.h>
 
+/**
+ * Stacks come in POOL_CLASSES size classes. Class 0 is PARAM_STACK_SIZE and
+ * every further class is a quarter of the previous one, down to
+ * POOL_MIN_STACK_SIZE.
+ */
+#ifndef POOL_CLASSES
+#define POOL_CLASSES 3
+#endif
 
-//#define POOL_WAIT_FREE
-//#define POOL_LOCAL_POOLS
-
-
+#ifndef POOL_MIN_STACK_SIZE
+#define POOL_MIN_STACK_SIZE 0x10000
+#endif
 
+void pool_init();
+void pool_exit();
+int pool_contains(void * addr);
+int pool_class(size_t size);
+int pool_stack_class(void * stack);
+size_t pool_stack_size(void * stack);
 void pool_put(void * stack);
 void * pool_take();
+void * pool_try_take();
+int pool_punch(void * addr, size_t size);
+int pool_grow(void * addr);
+void * pool_take_class(int cls);
+void pool_prealloc(int n);
+size_t pool_demand(void);
+size_t pool_trim(size_t keep);
 
 #endif /* end of include guard: POOL_H */
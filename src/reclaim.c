@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "pool.h"
+#include "safe.h"
+#include "sync.h"
+#include "param.h"
+#include "stats.h"
+#include "reclaim.h"
+
+/**
+ * Reclamation of stack pages.
+ *
+ * A suspended stack holds dead pages below the stack pointer of its frame,
+ * and a stack that goes back to the arena holds only dead pages. How they
+ * are given back to the kernel is up to PARAM_RECLAIM:
+ *
+ *  - none keeps the pages of suspended stacks, and releases whole stacks
+ *    with the advice of the pool;
+ *  - free and dontneed release both with MADV_FREE and MADV_DONTNEED;
+ *  - deferred keeps the pages of suspended stacks as well, and holds whole
+ *    stacks back in a per-worker batch, which is released with one madvise
+ *    per run of neighboring stacks once it is full or the worker is idle.
+ *
+ * Every stack records in the slot that stack_setup() reserves at its top
+ * how deep below its top it may have been written since its pages were
+ * last released. Steals, suspensions and returns into a stolen parent
+ * deepen the mark, and a suspension only releases the pages between the
+ * mark and PARAM_RESIDENT_BUDGET bytes below its stack pointer, if there
+ * are any. The mark does not see leaf calls that return without entering
+ * the runtime, so pages they touch below it are left for the release of
+ * the whole stack.
+ */
+#ifndef RECLAIM_BATCH_SIZE
+#define RECLAIM_BATCH_SIZE 32
+#endif
+
+/**
+ * The most bytes between two batched ranges that are released along with
+ * them: neighboring arena stacks are apart by a guard page.
+ */
+#define RECLAIM_MAX_GAP PARAM_PAGE_SIZE
+
+static __thread struct {
+  int count;
+  struct {
+    void * stack;
+    void * addr;
+    size_t size;
+    int advice;
+    void (*put)(void *);
+  } entry[RECLAIM_BATCH_SIZE];
+} _batch;
+
+static inline size_t * depth_of(void * stack)
+{
+  return (size_t *) (stack + pool_stack_size(stack)) - 1;
+}
+
+static inline int advice_of(int advice)
+{
+  switch (PARAM_RECLAIM) {
+    case PARAM_RECLAIM_FREE: return MADV_FREE;
+    case PARAM_RECLAIM_DONTNEED: return MADV_DONTNEED;
+  }
+
+  return advice;
+}
+
+static inline void release(void * addr, size_t size, int advice)
+{
+  /** Releasing part of a huge page would split it. */
+  if (PARAM_HUGE_PAGES != PARAM_HUGE_NONE && pool_contains(addr)) return;
+
+  /** A memfd arena frees pages only when they leave the file. */
+  if (!pool_punch(addr, size)) SAFE_NNCALL(madvise(addr, size, advice));
+  STATS_COUNT(N_MADVISE, 1);
+}
+
+/** Record that stack has been used down to rsp. */
+void reclaim_mark(void * stack, void * rsp)
+{
+  if (PARAM_RECLAIM != PARAM_RECLAIM_FREE &&
+      PARAM_RECLAIM != PARAM_RECLAIM_DONTNEED) return;
+  if (!stack || stack == PARAM_STACK_ADDR) return;
+
+  size_t size = pool_stack_size(stack);
+  if (rsp < stack || rsp >= stack + size) return;
+
+  /** Thieves mark the stacks they steal from while their owners run. */
+  size_t * depth = depth_of(stack);
+  size_t curr = fatomic_load_e(*depth, __ATOMIC_RELAXED);
+
+  while (curr < (size_t) (stack + size - rsp) &&
+      !fatomic_cas_e(*depth, curr, stack + size - rsp, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED));
+}
+
+/**
+ * Release the dead pages of a stack that is suspended at rsp. This must
+ * happen before the frame on the stack can be resumed.
+ */
+void reclaim_suspended(void * stack, void * rsp)
+{
+  if (PARAM_RECLAIM != PARAM_RECLAIM_FREE &&
+      PARAM_RECLAIM != PARAM_RECLAIM_DONTNEED) return;
+  if (stack == PARAM_STACK_ADDR) return;
+
+  void * top = stack + pool_stack_size(stack);
+  size_t * depth = depth_of(stack);
+
+  /** A stack from the heap may start out with garbage in its mark. */
+  void * lo = *depth < (size_t) (top - stack) ? top - *depth : stack;
+  void * hi = stack;
+
+  lo = PAGE_ALIGN_DOWN(lo);
+  if ((size_t) (rsp - stack) > PARAM_RESIDENT_BUDGET) {
+    hi = PAGE_ALIGN_DOWN(rsp - PARAM_RESIDENT_BUDGET);
+  }
+
+  if (hi > lo) {
+    release(lo, hi - lo, advice_of(MADV_FREE));
+    *depth = top - hi;
+  } else {
+    STATS_COUNT(N_MADVISE_SAVED, 1);
+  }
+
+  reclaim_mark(stack, rsp);
+}
+
+/**
+ * Release [addr, addr + size) of a stack that no one uses any more, with
+ * advice unless the policy names one, and then hand the stack to put.
+ */
+void reclaim_stack(void * stack, void * addr, size_t size, int advice,
+    void (*put)(void *))
+{
+  if (PARAM_RECLAIM != PARAM_RECLAIM_DEFERRED) {
+    release(addr, size, advice_of(advice));
+    put(stack);
+    return;
+  }
+
+  reclaim_batch(stack, addr, size, advice, put);
+}
+
+/** Like reclaim_stack(), but always hold the stack back in the batch. */
+void reclaim_batch(void * stack, void * addr, size_t size, int advice,
+    void (*put)(void *))
+{
+  int i = _batch.count++;
+
+  _batch.entry[i].stack = stack;
+  _batch.entry[i].addr = addr;
+  _batch.entry[i].size = size;
+  _batch.entry[i].advice = advice_of(advice);
+  _batch.entry[i].put = put;
+
+  if (_batch.count == RECLAIM_BATCH_SIZE) reclaim_flush();
+}
+
+/** Release the batch of the calling worker. */
+void reclaim_flush(void)
+{
+  int n = _batch.count;
+  int i, j;
+
+  if (n == 0) return;
+
+  /** Sort by address so that neighboring stacks are released together. */
+  for (i = 1; i < n; ++i) {
+    __typeof__(_batch.entry[0]) e = _batch.entry[i];
+
+    for (j = i; j > 0 && _batch.entry[j - 1].addr > e.addr; --j) {
+      _batch.entry[j] = _batch.entry[j - 1];
+    }
+
+    _batch.entry[j] = e;
+  }
+
+  void * addr = _batch.entry[0].addr;
+  void * end = addr + _batch.entry[0].size;
+
+  for (i = 1; i <= n; ++i) {
+    if (i < n && _batch.entry[i].advice == _batch.entry[i - 1].advice &&
+        (size_t) (_batch.entry[i].addr - end) <= RECLAIM_MAX_GAP &&
+        pool_contains(end) && pool_contains(_batch.entry[i].addr)) {
+      end = _batch.entry[i].addr + _batch.entry[i].size;
+      STATS_COUNT(N_MADVISE_SAVED, 1);
+      continue;
+    }
+
+    release(addr, end - addr, _batch.entry[i - 1].advice);
+
+    if (i < n) {
+      addr = _batch.entry[i].addr;
+      end = addr + _batch.entry[i].size;
+    }
+  }
+
+  _batch.count = 0;
+
+  for (i = 0; i < n; ++i) _batch.entry[i].put(_batch.entry[i].stack);
+}
+
+/**
+ * The reclaimer is a thread of the lowest priority that wakes up every
+ * PARAM_RECLAIM_PERIOD ms and trims the shared pools down to the number of
+ * stacks that the workers took from beyond their private pools per period,
+ * averaged with weight 2^-RECLAIM_EWMA_SHIFT for the latest period, but not
+ * below the stacks that have been preallocated. Stacks left over from a
+ * burst are thus given back once it has passed, with the madvise and free
+ * calls batched on the reclaimer instead of the workers.
+ *
+ * With PARAM_PRESSURE_FILE, the reclaimer also reads the memory pressure
+ * every period, or every RECLAIM_PRESSURE_PERIOD ms if it has no period of
+ * its own, and publishes its level in reclaim_pressure. Under pressure it
+ * trims the shared pools down to the preallocated stacks, the workers
+ * steal less often and give full magazines back to the arena, and under
+ * full pressure steals only run on stacks that are already pooled.
+ */
+#ifndef RECLAIM_EWMA_SHIFT
+#define RECLAIM_EWMA_SHIFT 2
+#endif
+
+/** Fraction bits of the average. */
+#define RECLAIM_FIXED_SHIFT 8
+
+#ifndef RECLAIM_PRESSURE_PERIOD
+#define RECLAIM_PRESSURE_PERIOD 100
+#endif
+
+int volatile reclaim_pressure;
+
+/** Read the level of memory pressure from PARAM_PRESSURE_FILE. */
+static int pressure_read(void)
+{
+  FILE * file = fopen(PARAM_PRESSURE_FILE, "r");
+  if (!file) return RECLAIM_PRESSURE_NONE;
+
+  char kind[8];
+  double avg10;
+  int level = RECLAIM_PRESSURE_NONE;
+
+  /** Lines read like: some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+  while (fscanf(file, "%7s avg10=%lf%*[^\n]", kind, &avg10) == 2) {
+    if (strcmp(kind, "full") == 0 && avg10 >= PARAM_PRESSURE_FULL) {
+      level = RECLAIM_PRESSURE_FULL;
+    } else if (strcmp(kind, "some") == 0 && avg10 >= PARAM_PRESSURE_SOME &&
+        level == RECLAIM_PRESSURE_NONE) {
+      level = RECLAIM_PRESSURE_SOME;
+    }
+  }
+
+  fclose(file);
+  return level;
+}
+
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+} _reclaimer = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void * reclaimer(void * unused __attribute__((unused)))
+{
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+  long target = 0;
+  unsigned long period = PARAM_RECLAIM_PERIOD ? PARAM_RECLAIM_PERIOD :
+    RECLAIM_PRESSURE_PERIOD;
+
+  pthread_mutex_lock(&_reclaimer.lock);
+
+  while (!_reclaimer.stop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    ts.tv_sec += period / 1000;
+    ts.tv_nsec += (period % 1000) * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    pthread_cond_timedwait(&_reclaimer.cond, &_reclaimer.lock, &ts);
+    if (_reclaimer.stop) break;
+
+    pthread_mutex_unlock(&_reclaimer.lock);
+
+    int pressure = RECLAIM_PRESSURE_NONE;
+
+    if (PARAM_PRESSURE_FILE) {
+      pressure = pressure_read();
+
+      if (pressure != reclaim_pressure) {
+        DEBUG_DUMP(1, "reclaim:", (pressure, "%d"));
+        fatomic_store(reclaim_pressure, pressure);
+      }
+    }
+
+    long demand = pool_demand() << RECLAIM_FIXED_SHIFT;
+    target += (demand - target) >> RECLAIM_EWMA_SHIFT;
+
+    size_t keep = (target + (1 << RECLAIM_FIXED_SHIFT) - 1) >>
+      RECLAIM_FIXED_SHIFT;
+    if (pressure) keep = 0;
+
+    /** Never undo a preallocation. */
+    size_t prealloc = (size_t) PARAM_PREALLOC_STACKS * PARAM_NPROCS;
+    if (keep < prealloc) keep = prealloc;
+
+    if (PARAM_RECLAIM_PERIOD || pressure) {
+      size_t trimmed = pool_trim(keep);
+      DEBUG_DUMP(3, "reclaim:", (keep, "%lu"), (trimmed, "%lu"));
+    }
+
+    pthread_mutex_lock(&_reclaimer.lock);
+  }
+
+  pthread_mutex_unlock(&_reclaimer.lock);
+  return NULL;
+}
+
+/** Start the reclaimer if it has a period or a pressure file to read. */
+void reclaim_start(void)
+{
+  if (!PARAM_RECLAIM_PERIOD && !PARAM_PRESSURE_FILE) return;
+
+  _reclaimer.stop = 0;
+  reclaim_pressure = RECLAIM_PRESSURE_NONE;
+  SAFE_RZCALL(pthread_create(&_reclaimer.thread, NULL, reclaimer, NULL));
+}
+
+/** Stop the reclaimer; the pools must not be released before. */
+void reclaim_stop(void)
+{
+  if (!PARAM_RECLAIM_PERIOD && !PARAM_PRESSURE_FILE) return;
+
+  pthread_mutex_lock(&_reclaimer.lock);
+  _reclaimer.stop = 1;
+  pthread_cond_signal(&_reclaimer.cond);
+  pthread_mutex_unlock(&_reclaimer.lock);
+
+  SAFE_RZCALL(pthread_join(_reclaimer.thread, NULL));
+}
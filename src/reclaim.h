@@ -0,0 +1,23 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stddef.h>
+
+/** Levels of memory pressure, as published by the reclaimer. */
+#define RECLAIM_PRESSURE_NONE 0
+#define RECLAIM_PRESSURE_SOME 1
+#define RECLAIM_PRESSURE_FULL 2
+
+extern int volatile reclaim_pressure;
+
+void reclaim_mark(void * stack, void * rsp);
+void reclaim_suspended(void * stack, void * rsp);
+void reclaim_stack(void * stack, void * addr, size_t size, int advice,
+    void (*put)(void *));
+void reclaim_batch(void * stack, void * addr, size_t size, int advice,
+    void (*put)(void *));
+void reclaim_flush(void);
+void reclaim_start(void);
+void reclaim_stop(void);
+
+#endif /* end of include guard: RECLAIM_H */
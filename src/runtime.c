@@ -1,10 +1,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
+#include "pool.h"
+#include "cores.h"
 #include "safe.h"
+#include "sync.h"
 #include "debug.h"
 #include "param.h"
 #include "stats.h"
+#include "reclaim.h"
 
 static pthread_t * _procs;
 static void ** _stacks;
@@ -13,6 +17,7 @@ __thread int _tid;
 
 extern void fibrili_init(int id, int nprocs);
 extern void fibrili_exit(int id, int nprocs);
+extern void fibrili_set_nprocs(int n);
 
 #ifdef FIBRIL_STATS
 void * MAIN_STACK_TOP;
@@ -22,6 +27,7 @@ static void * __main(void * id)
 {
   _tid = (int) (intptr_t) id;
 
+  pool_prealloc(PARAM_PREALLOC_STACKS);
   fibrili_init(_tid, PARAM_NPROCS);
   return NULL;
 }
@@ -38,6 +44,9 @@ int fibril_rt_nprocs()
 int fibril_rt_init(int n)
 {
   param_init(n);
+  pool_init();
+  cores_init();
+  reclaim_start();
 
   int nprocs = PARAM_NPROCS;
   if (nprocs <= 0) return -1;
@@ -76,6 +85,23 @@ int fibril_rt_init(int n)
   return 0;
 }
 
+int fibril_rt_set_nprocs(int n)
+{
+  if (n <= 0 || n > PARAM_NPROCS) return -1;
+
+  fibrili_set_nprocs(n);
+  return 0;
+}
+
+int fibril_rt_prealloc(int n)
+{
+  if (n <= 0) return 0;
+
+  PARAM_PREALLOC_STACKS += n;
+  pool_prealloc(n * PARAM_NPROCS);
+  return 0;
+}
+
 int fibril_rt_exit()
 {
   fibrili_exit(_tid, PARAM_NPROCS);
@@ -89,11 +115,32 @@ int fibril_rt_exit()
 
   free(_procs);
   free(_stacks);
+  sync_exit();
+  cores_exit();
+  reclaim_stop();
+
+  if (!STATS_FAULTS) {
+    STATS_COUNT(N_PAGES, stats_mincore(PARAM_STACK_ADDR,
+          PARAM_MAIN_STACK_SIZE));
+  }
+
+  pool_exit();
 
   STATS_EXPORT(N_STEALS);
   STATS_EXPORT(N_SUSPENSIONS);
   STATS_EXPORT(N_STACKS);
   STATS_EXPORT(N_PAGES);
+  STATS_EXPORT(N_CANCELS);
+  STATS_EXPORT(N_MADVISE);
+  STATS_EXPORT(N_MADVISE_SAVED);
+  STATS_EXPORT(N_TRIMMED);
+  STATS_EXPORT(N_REMOTE_STACKS);
+  STATS_EXPORT(N_REMOTE_FREES);
+  STATS_EXPORT(N_THROTTLED);
+  STATS_EXPORT(N_PRESSURED);
+  STATS_EXPORT(N_GROWS);
+  STATS_EXPORT(N_PARKS);
+  STATS_RESIDENT_EXPORT(PARAM_NPROCS);
 
   return 0;
 }
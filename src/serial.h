@@ -1,11 +1,26 @@
 #ifndef FIBRIL_SERIAL_H
 #define FIBRIL_SERIAL_H
 
+#include <time.h>
+
 #define fibril
 #define fibril_t __attribute__((unused)) int
 #define fibril_init(fp)
 #define fibril_join(fp)
 
+#define fibril_token_t __attribute__((unused)) int
+#define fibril_token_init(fp, tk) ((void) (fp), (void) (tk))
+#define fibril_cancel(tk) ((void) (tk))
+#define fibril_cancelled() (0)
+#define fibril_stack_hint(fp, size) ((void) (fp), (void) (size))
+#define fibril_rt_prealloc(n) ((void) (n))
+#define fibril_rt_set_nprocs(n) ((void) (n))
+#define fibril_sleep_ns(ns) do { \
+  struct timespec _ts = { (time_t) ((ns) / 1000000000), \
+    (long) ((ns) % 1000000000) }; \
+  nanosleep(&_ts, NULL); \
+} while (0)
+
 #define fibril_fork_nrt(fp, fn, ag) (fn ag)
 #define fibril_fork_wrt(fp, rtp, fn, ag) (*rtp = fn ag)
 
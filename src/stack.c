@@ -10,60 +10,84 @@
 #include "param.h"
 #include "stack.h"
 #include "stats.h"
+#include "reclaim.h"
 
 #ifdef FIBRIL_STATS
 extern void * MAIN_STACK_TOP;
+#endif
 
-void handle_segfault(int s, siginfo_t * si, void * unused)
-{
-  if (si->si_code != SEGV_ACCERR) {
-    struct sigaction default_action = {
-      .sa_handler = SIG_DFL,
-      .sa_sigaction = NULL,
-      .sa_mask = 0,
-      .sa_flags = 0,
-      .sa_restorer = NULL
-    };
-    sigaction(SIGSEGV, &default_action, NULL);
-    return;
-  }
+/** Size of the alternate signal stack of a worker. */
+#define STACK_ALTSTACK_SIZE (16 * PARAM_PAGE_SIZE)
+
+/** The frame whose continuation runs on the current stack of the worker. */
+static __thread struct _fibril_t * _frame;
 
+static void handle_segfault(int s __attribute__((unused)), siginfo_t * si,
+    void * unused __attribute__((unused)))
+{
   void * stack = fibrili_deq.stack;
   void * addr = PAGE_ALIGN_DOWN(si->si_addr);
-  if (addr < stack || addr >= stack + PARAM_STACK_SIZE) return;
 
-  STATS_COUNT(N_PAGES, 1);
-  SAFE_NNCALL(mprotect(addr, PARAM_PAGE_SIZE, PROT_READ | PROT_WRITE));
-}
+  /** Every pooled stack sits right above its guard page. */
+  if (stack && addr < stack && addr >= stack - PARAM_PAGE_SIZE) {
+    void * fault = si->si_addr;
+    void * frame = _frame;
+    void * pc = _frame ? _frame->pc : NULL;
+
+    DEBUG_DUMP(0, "error: fibril stack overflow:", (fault, "%p"),
+        (stack, "%p"), (frame, "%p"), (pc, "%p"));
+    goto crash;
+  }
+
+  /** A growable stack faults below the part that it has grown to. */
+  if (si->si_code == SEGV_ACCERR && pool_grow(si->si_addr)) return;
+
+#ifdef FIBRIL_STATS
+  if (STATS_FAULTS && si->si_code == SEGV_ACCERR &&
+      addr >= stack && addr < stack + pool_stack_size(stack)) {
+    STATS_COUNT(N_PAGES, 1);
+    SAFE_NNCALL(mprotect(addr, PARAM_PAGE_SIZE, PROT_READ | PROT_WRITE));
+    return;
+  }
 #endif
 
+crash:;
+  /** Let the faulting instruction run again and take the default action. */
+  struct sigaction default_action = { .sa_handler = SIG_DFL };
+  sigaction(SIGSEGV, &default_action, NULL);
+}
+
 void stack_init(int id)
 {
-#ifdef FIBRIL_STATS
+  /**
+   * An overflowed stack has no room left for the handler, so every worker
+   * takes its signals on a stack of its own.
+   */
   stack_t altstack = {
     .ss_flags = 0,
-    .ss_size = PARAM_STACK_SIZE
+    .ss_size = STACK_ALTSTACK_SIZE
   };
   SAFE_RZCALL(posix_memalign(&altstack.ss_sp, PARAM_PAGE_SIZE,
-        PARAM_STACK_SIZE));
+        STACK_ALTSTACK_SIZE));
   SAFE_NNCALL(sigaltstack(&altstack, NULL));
 
   struct sigaction sa = {
-    .sa_flags = SA_SIGINFO | SA_STACK,
+    .sa_flags = SA_SIGINFO | SA_ONSTACK,
     .sa_sigaction = handle_segfault,
   };
   SAFE_NNCALL(sigaction(SIGSEGV, &sa, NULL));
-#endif
 
   if (id == 0) {
     fibrili_deq.stack = PARAM_STACK_ADDR;
 
 #ifdef FIBRIL_STATS
+    if (!STATS_FAULTS) return;
+
     SAFE_ASSERT(MAIN_STACK_TOP >= PARAM_STACK_ADDR);
-    SAFE_ASSERT(MAIN_STACK_TOP < (PARAM_STACK_ADDR + PARAM_STACK_SIZE));
+    SAFE_ASSERT(MAIN_STACK_TOP < (PARAM_STACK_ADDR + PARAM_MAIN_STACK_SIZE));
     size_t size = MAIN_STACK_TOP - PARAM_STACK_ADDR;
 
-    STATS_COUNT(N_PAGES, ((PARAM_STACK_ADDR + PARAM_STACK_SIZE) -
+    STATS_COUNT(N_PAGES, ((PARAM_STACK_ADDR + PARAM_MAIN_STACK_SIZE) -
           MAIN_STACK_TOP)  / PARAM_PAGE_SIZE);
 
     int flags = MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
@@ -72,28 +96,73 @@ void stack_init(int id)
   }
 }
 
+/**
+ * With PARAM_MAX_STACKS or under full memory pressure, a worker must hold a
+ * full-sized stack, which any stolen continuation fits on, before it
+ * steals, so that stack_setup() never has to allocate beyond the limit.
+ * Frames that the worker resumes from the ready list or its own deque must
+ * run whatever the limit, and go without; the stacks that they take beyond
+ * it keep steals from taking new ones until they have been given back.
+ * @return Return 0 if the worker has no such stack and cannot get one.
+ */
+int stack_reserve(void)
+{
+  void * stack = fibrili_deq.stack;
+
+  if (!PARAM_MAX_STACKS &&
+      fatomic_load(reclaim_pressure) != RECLAIM_PRESSURE_FULL) return 1;
+  if (stack && pool_stack_class(stack) == 0) return 1;
+
+  void * full = pool_try_take();
+
+  if (!full) {
+    STATS_COUNT(N_THROTTLED, 1);
+    return 0;
+  }
+
+  if (stack) pool_put(stack);
+  fibrili_deq.stack = full;
+  return 1;
+}
+
 void * stack_setup(struct _fibril_t * frptr)
 {
-  void ** rsp = fibrili_deq.stack + PARAM_STACK_SIZE;
+  void * stack = fibrili_deq.stack;
+  int cls = pool_class(frptr->stack.hint);
+
+  /** Trade a stack that is too small to hold the continuation. */
+  if (stack && pool_stack_class(stack) > cls) {
+    pool_put(stack);
+    stack = NULL;
+  }
+
+  if (!stack) fibrili_deq.stack = stack = pool_take_class(cls);
+  _frame = frptr;
+  SAFE_ASSERT(stack != PARAM_STACK_ADDR);
+
+  void ** rsp = stack + pool_stack_size(stack);
 
   /** Reserve 128 byte at the bottom. */
   rsp -= 16;
   return rsp;
 }
 
+/**
+ * A suspended frame keeps its stack, however shallow it is. The frame must
+ * not move: a thief runs its continuation with rbp pointing into it, its
+ * children count down frptr->count and store their results through
+ * pointers into it while it is suspended, and its locals may point at each
+ * other once it resumes. Only its dead pages can go, which is up to
+ * reclaim_suspended().
+ */
 int stack_uninstall(struct _fibril_t * frptr)
 {
   DEBUG_ASSERT(frptr != NULL);
 
   fibrili_deq.stack = NULL;
 
-#ifdef FIBRIL_USE_MADVISE
-  void * addr = frptr->stack.ptr;
-  if (addr != PARAM_STACK_ADDR) {
-    size_t size = PAGE_ALIGN_DOWN(frptr->stack.top) - addr;
-    SAFE_NNCALL(madvise(addr, size, MADV_FREE));
-  }
-#endif
+  reclaim_suspended(frptr->stack.ptr, frptr->stack.top);
+  STATS_RESIDENT(frptr->stack.ptr, pool_stack_size(frptr->stack.ptr));
 
   return 1;
 }
@@ -108,5 +177,6 @@ void stack_reinstall(struct _fibril_t * frptr)
   if (addr) pool_put(addr);
 
   fibrili_deq.stack = frptr->stack.ptr;
+  _frame = frptr;
 }
 
@@ -4,6 +4,7 @@
 #include "fibrili.h"
 
 void stack_init(int id);
+int stack_reserve(void);
 void * stack_setup(struct _fibril_t * frptr);
 void stack_reinstall(struct _fibril_t * frptr);
 int stack_uninstall(struct _fibril_t * frptr);
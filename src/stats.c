@@ -2,6 +2,121 @@
 
 #ifdef FIBRIL_STATS
 
+#include <stdio.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "param.h"
+
 struct _stats_counter_t _stats_table[STATS_LAST_ENTRY];
 
+/**
+ * With PARAM_PAGE_STATS_MINCORE, every worker samples the resident pages of
+ * one in STATS_SAMPLE_PERIOD stacks that it suspends, after their dead
+ * pages have been released, and keeps the peak and the sum of its samples.
+ * Workers beyond STATS_MAX_WORKERS share the last slot.
+ */
+#ifndef STATS_SAMPLE_PERIOD
+#define STATS_SAMPLE_PERIOD 16
+#endif
+
+#ifndef STATS_MAX_WORKERS
+#define STATS_MAX_WORKERS 256
+#endif
+
+#define STATS_MINCORE_CHUNK 4096
+
+static struct {
+  size_t peak;
+  size_t sum;
+  size_t samples;
+} __attribute__((aligned(64))) _resident[STATS_MAX_WORKERS];
+
+static __thread unsigned _suspensions;
+
+/**
+ * Count the resident pages in [addr, addr + size). Only the top of a range
+ * may be mapped, as with the main stack, which grows on demand; the pages
+ * below are not counted.
+ */
+size_t stats_mincore(void * addr, size_t size)
+{
+  unsigned char vec[STATS_MINCORE_CHUNK];
+  size_t pages = size / PARAM_PAGE_SIZE;
+  size_t n = 0;
+
+  while (pages > 0) {
+    size_t chunk = pages < STATS_MINCORE_CHUNK ? pages : STATS_MINCORE_CHUNK;
+    size_t lo = 0;
+    size_t hi = chunk;
+    size_t i;
+
+    if (mincore(addr, chunk * PARAM_PAGE_SIZE, vec) != 0) {
+      /** Search for the lowest page from which on the chunk is mapped. */
+      while (lo + 1 < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (mincore(addr + mid * PARAM_PAGE_SIZE,
+              (chunk - mid) * PARAM_PAGE_SIZE, vec) == 0) hi = mid;
+        else lo = mid;
+      }
+
+      if (hi == chunk || mincore(addr + hi * PARAM_PAGE_SIZE,
+            (chunk - hi) * PARAM_PAGE_SIZE, vec) != 0) hi = chunk;
+    } else {
+      hi = 0;
+    }
+
+    for (i = 0; i < chunk - hi; ++i) n += vec[i] & 1;
+
+    addr += chunk * PARAM_PAGE_SIZE;
+    pages -= chunk;
+  }
+
+  return n;
+}
+
+void stats_resident(void * stack, size_t size)
+{
+  if (STATS_FAULTS || _suspensions++ % STATS_SAMPLE_PERIOD) return;
+
+  int id = _tid < STATS_MAX_WORKERS ? _tid : STATS_MAX_WORKERS - 1;
+  size_t n = stats_mincore(stack, size);
+
+  _resident[id].sum += n;
+  _resident[id].samples++;
+  if (n > _resident[id].peak) _resident[id].peak = n;
+}
+
+/**
+ * Export the peak and the average of the samples of every worker as
+ * FIBRIL_RESIDENT_PAGES, one peak/average pair per worker, and start over.
+ */
+void stats_resident_export(int nprocs)
+{
+  if (STATS_FAULTS) return;
+  if (nprocs > STATS_MAX_WORKERS) nprocs = STATS_MAX_WORKERS;
+
+  char buff[STATS_MAX_WORKERS * 32];
+  size_t len = 0;
+  int i;
+
+  buff[0] = '\0';
+
+  for (i = 0; i < nprocs; ++i) {
+    double avg = _resident[i].samples ?
+      (double) _resident[i].sum / _resident[i].samples : 0;
+
+    if (len < sizeof(buff)) {
+      len += snprintf(buff + len, sizeof(buff) - len, "%s%lu/%.1f",
+          i ? " " : "", _resident[i].peak, avg);
+    }
+
+    _resident[i].peak = 0;
+    _resident[i].sum = 0;
+    _resident[i].samples = 0;
+  }
+
+  setenv("FIBRIL_RESIDENT_PAGES", buff, 1);
+}
+
 #endif
@@ -13,6 +13,9 @@
 #define STATS_INC(...)
 #define STATS_DEC(...)
 #define STATS_EXPORT(...)
+#define STATS_RESIDENT(...)
+#define STATS_RESIDENT_EXPORT(...)
+#define STATS_FAULTS 0
 
 #else // FIBRIL_STATS defined
 
@@ -24,6 +27,16 @@ typedef enum _stats_t {
   N_SUSPENSIONS,
   N_STACKS,
   N_PAGES,
+  N_CANCELS, /** Steals skipped as cancelled; DEQUE_USE_THE only. */
+  N_MADVISE,
+  N_MADVISE_SAVED,
+  N_TRIMMED,
+  N_REMOTE_STACKS,
+  N_REMOTE_FREES,
+  N_THROTTLED,
+  N_PRESSURED,
+  N_GROWS,
+  N_PARKS,
   STATS_LAST_ENTRY /** No more enum entries after this. */
 } stats_t;
 
@@ -55,5 +68,16 @@ extern struct _stats_counter_t {
   setenv("FIBRIL_" #e, tmp, 1); \
 } while (0)
 
+/** Whether stack pages are counted by faulting on their first touch. */
+#define STATS_FAULTS (PARAM_PAGE_STATS == PARAM_PAGE_STATS_FAULT)
+
+/** Sample the resident pages of a stack that is being suspended. */
+#define STATS_RESIDENT(stack, size) stats_resident(stack, size)
+#define STATS_RESIDENT_EXPORT(nprocs) stats_resident_export(nprocs)
+
+size_t stats_mincore(void * addr, size_t size);
+void stats_resident(void * stack, size_t size);
+void stats_resident_export(int nprocs);
+
 #endif
 #endif /* end of include guard: STATS_H */
@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "safe.h"
+#include "sync.h"
+
+/**
+ * sync_barrier() is a dissemination barrier. In round r, thread i signals
+ * thread (i + 2^r) % nprocs and waits for thread (i - 2^r) % nprocs, so
+ * that after log2(nprocs) rounds every thread has heard from every other,
+ * and each one only ever spins on flags of its own.
+ *
+ * Every thread counts the episodes that it has been through in steps of 2,
+ * and signals a round by storing the count into the flag of its partner. A
+ * waiter spins on its flag for SYNC_SPINS iterations, and then sets the
+ * SYNC_SLEEPING bit in it and sleeps on it with a futex; a signaller that
+ * finds the bit wakes it up. Counts rather than senses let a partner run
+ * into the next episode before the waiter has seen the last one.
+ */
+#ifndef SYNC_SPINS
+#define SYNC_SPINS 4096
+#endif
+
+#define SYNC_ROUNDS 15
+#define SYNC_SLEEPING 1
+
+struct _sync_node_t {
+  int volatile flag[SYNC_ROUNDS];
+  int episode;
+} __attribute__((aligned(64)));
+
+/**
+ * Allocated by the first thread to arrive, and freed by sync_exit(); nprocs
+ * must not change in between.
+ */
+static struct _sync_node_t * volatile _nodes;
+
+/**
+ * Sleep on addr while it holds val, for at most us microseconds; 0 means
+ * no limit. Wakes up spuriously as any futex does.
+ */
+void sync_sleep(int volatile * addr, int val, unsigned long us)
+{
+  struct timespec ts = {
+    .tv_sec = us / 1000000,
+    .tv_nsec = us % 1000000 * 1000
+  };
+
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, us ? &ts : NULL,
+      NULL, 0);
+}
+
+/** Wake up to n threads sleeping on addr. */
+void sync_wake(int volatile * addr, int n)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static struct _sync_node_t * sync_nodes(int nprocs)
+{
+  struct _sync_node_t * nodes = _nodes;
+
+  if (!nodes) {
+    SAFE_RZCALL(posix_memalign((void **) &nodes, sizeof(nodes[0]),
+          sizeof(nodes[0]) * nprocs));
+    memset(nodes, 0, sizeof(nodes[0]) * nprocs);
+
+    struct _sync_node_t * prev = sync_cas(&_nodes, NULL, nodes);
+
+    if (prev) {
+      free(nodes);
+      nodes = prev;
+    }
+  }
+
+  return nodes;
+}
+
+static void sync_wait(int volatile * flag, int episode)
+{
+  int spins = SYNC_SPINS;
+  int val;
+
+  while ((val = *flag) - episode < 0) {
+    if (spins > 0) {
+      spins--;
+      __asm__ ( "pause" ::: "memory" );
+    } else if ((val & SYNC_SLEEPING) ||
+        sync_cas(flag, val, val | SYNC_SLEEPING) == val) {
+      sync_sleep(flag, val | SYNC_SLEEPING, 0);
+    }
+  }
+}
+
+static void sync_signal(int volatile * flag, int episode)
+{
+  if (sync_swap(flag, episode) & SYNC_SLEEPING) {
+    sync_wake(flag, INT_MAX);
+  }
+}
+
+void sync_barrier(int id, int nprocs)
+{
+  struct _sync_node_t * nodes = sync_nodes(nprocs);
+
+  int episode = nodes[id].episode += 2;
+  int dist, r;
+
+  for (r = 0, dist = 1; dist < nprocs; ++r, dist <<= 1) {
+    SAFE_ASSERT(r < SYNC_ROUNDS);
+    sync_signal(&nodes[(id + dist) % nprocs].flag[r], episode);
+    sync_wait(&nodes[id].flag[r], episode);
+  }
+
+  sync_fence();
+}
+
+/** Free the nodes once no thread is left in a barrier, for the next run. */
+void sync_exit(void)
+{
+  free((void *) _nodes);
+  _nodes = NULL;
+}
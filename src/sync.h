@@ -23,22 +23,9 @@
 #endif
 #endif
 
-static inline void sync_barrier(int nprocs)
-{
-  static volatile int _count;
-  static volatile int _sense;
-  static __thread volatile int _local_sense;
-
-  int sense = !_local_sense;
-
-  if (sync_fadd(_count, 1) == nprocs - 1) {
-    _count = 0;
-    _sense = sense;
-  }
-
-  while (_sense != sense);
-  _local_sense = sense;
-  sync_fence();
-}
+void sync_barrier(int id, int nprocs);
+void sync_exit(void);
+void sync_sleep(int volatile * addr, int val, unsigned long us);
+void sync_wake(int volatile * addr, int n);
 
 #endif /* end of include guard: SYNC_H */
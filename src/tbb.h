@@ -3,12 +3,27 @@
 
 #include <tbb/task_group.h>
 #include <tbb/task_scheduler_init.h>
+#include <time.h>
+#include <stdlib.h>
 
 #define fibril
 #define fibril_t tbb::task_group
 #define fibril_init(fp)
 #define fibril_join(fp) (fp)->wait()
 
+#define fibril_token_t __attribute__((unused)) int
+#define fibril_token_init(fp, tk) ((void) (fp), (void) (tk))
+#define fibril_cancel(tk) ((void) (tk))
+#define fibril_cancelled() (0)
+#define fibril_stack_hint(fp, size) ((void) (fp), (void) (size))
+#define fibril_rt_prealloc(n) ((void) (n))
+#define fibril_rt_set_nprocs(n) ((void) (n))
+#define fibril_sleep_ns(ns) do { \
+  struct timespec _ts = { (time_t) ((ns) / 1000000000), \
+    (long) ((ns) % 1000000000) }; \
+  nanosleep(&_ts, NULL); \
+} while (0)
+
 #define fibril_fork_nrt(fp, fn, ag) (fp)->run([=]{ fn ag; })
 #define fibril_fork_wrt(fp, rtp, fn, ag) do { \
   __typeof__(rtp) pt = rtp; \
@@ -29,7 +44,9 @@ extern "C" {
       PARAM_NPROCS = max_nprocs; \
     } \
   } while(0); \
-tbb::task_scheduler_init _fibril_rt_init(PARAM_NPROCS, 0x100000)
+tbb::task_scheduler_init _fibril_rt_init(PARAM_NPROCS, \
+    getenv("FIBRIL_STACK_SIZE") ? \
+    strtoul(getenv("FIBRIL_STACK_SIZE"), NULL, 0) : 0x100000)
 
 #define fibril_rt_exit()
 
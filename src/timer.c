@@ -0,0 +1,124 @@
+#include <time.h>
+#include "debug.h"
+#include "timer.h"
+
+/**
+ * A hierarchical timer wheel per worker. Sleeping fibrils are filed into the
+ * wheel of the worker they went to sleep on, and only that worker advances
+ * it from its steal loop, so the wheel needs no synchronization. A tick is
+ * 2^TIMER_TICK_SHIFT ns; level l has TIMER_SLOTS slots of TIMER_SLOTS^l
+ * ticks each, and its entries cascade to the lower levels as time passes.
+ */
+#ifndef TIMER_TICK_SHIFT
+#define TIMER_TICK_SHIFT 14
+#endif
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+/** Deadlines further out than this are filed at the end of the wheel. */
+#define TIMER_RANGE (1ULL << (TIMER_BITS * TIMER_LEVELS))
+
+typedef struct _fibrili_timer_t timer_entry_t;
+
+static __thread struct {
+  uint64_t tick;
+  long count;
+  timer_entry_t * slots[TIMER_LEVELS][TIMER_SLOTS];
+} _wheel;
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fire(timer_entry_t * tm)
+{
+  DEBUG_DUMP(3, "timer_fire:", (tm->frptr, "%p"), (_wheel.tick, "%lu"));
+  _wheel.count--;
+  fibrili_unpark(tm->frptr);
+}
+
+static void insert(timer_entry_t * tm)
+{
+  if (tm->deadline <= _wheel.tick) {
+    fire(tm);
+    return;
+  }
+
+  uint64_t when = tm->deadline;
+  uint64_t delta = when - _wheel.tick;
+  int level = 0;
+
+  if (delta >= TIMER_RANGE) {
+    when = _wheel.tick + TIMER_RANGE - 1;
+    delta = TIMER_RANGE - 1;
+  }
+
+  while (delta >= (1ULL << (TIMER_BITS * (level + 1)))) level++;
+
+  timer_entry_t ** slot =
+    &_wheel.slots[level][(when >> (TIMER_BITS * level)) & TIMER_MASK];
+
+  tm->next = *slot;
+  *slot = tm;
+}
+
+/** Empty a slot and file its entries again relative to the current tick. */
+static void cascade(int level, int index)
+{
+  timer_entry_t * tm = _wheel.slots[level][index];
+  _wheel.slots[level][index] = NULL;
+
+  while (tm) {
+    /** A fired entry may be reused by its fibril right away. */
+    timer_entry_t * next = tm->next;
+    insert(tm);
+    tm = next;
+  }
+}
+
+void fibrili_sleep(struct _fibrili_timer_t * tm, uint64_t ns)
+{
+  uint64_t now = now_ns();
+
+  if (_wheel.count == 0) _wheel.tick = now >> TIMER_TICK_SHIFT;
+
+  /** Round up, so that a fibril never wakes up early. */
+  tm->deadline = (now + ns + (1ULL << TIMER_TICK_SHIFT) - 1)
+    >> TIMER_TICK_SHIFT;
+
+  _wheel.count++;
+  insert(tm);
+}
+
+/** Return whether any fibril sleeps in the wheel of this worker. */
+int timer_pending(void)
+{
+  return _wheel.count > 0;
+}
+
+void timer_poll(void)
+{
+  if (_wheel.count == 0) return;
+
+  uint64_t now = now_ns() >> TIMER_TICK_SHIFT;
+
+  while (_wheel.tick < now && _wheel.count > 0) {
+    uint64_t tick = ++_wheel.tick;
+    int level = 1;
+
+    while (level < TIMER_LEVELS &&
+        (tick & ((1ULL << (TIMER_BITS * level)) - 1)) == 0) level++;
+
+    while (--level > 0) {
+      cascade(level, (tick >> (TIMER_BITS * level)) & TIMER_MASK);
+    }
+
+    cascade(0, tick & TIMER_MASK);
+  }
+}
@@ -0,0 +1,9 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "fibrili.h"
+
+void timer_poll(void);
+int timer_pending(void);
+
+#endif /* end of include guard: TIMER_H */
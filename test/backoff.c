@@ -0,0 +1,118 @@
+/*
+ * Retry with exponential backoff on a resource of limited capacity.
+ *
+ * Every task tries to take one of a few units of a shared resource, and
+ * sleeps with fibril_sleep_ns() between failed attempts, doubling the delay
+ * each time. Holding a unit is a sleep as well, which is checked not to
+ * return early. No worker is blocked by any of these sleeps.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "test.h"
+
+#ifndef BENCHMARK
+int n = 256;
+#else
+int n = 16384;
+#endif
+
+#define CAPACITY 4
+#define HOLD_NS 100000
+#define MIN_BACKOFF_NS 10000
+#define MAX_BACKOFF_NS 1000000
+
+static int units;
+static int in_use;
+static int max_in_use;
+static int early;
+static int done;
+
+static unsigned long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int try_take(void)
+{
+  int avail = __atomic_load_n(&units, __ATOMIC_ACQUIRE);
+
+  while (avail > 0) {
+    if (__atomic_compare_exchange_n(&units, &avail, avail - 1, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return 1;
+  }
+
+  return 0;
+}
+
+static fibril void task(void)
+{
+  unsigned long backoff = MIN_BACKOFF_NS;
+
+  while (!try_take()) {
+    fibril_sleep_ns(backoff);
+    if (backoff < MAX_BACKOFF_NS) backoff *= 2;
+  }
+
+  int cur = __atomic_add_fetch(&in_use, 1, __ATOMIC_ACQ_REL);
+  int max = __atomic_load_n(&max_in_use, __ATOMIC_RELAXED);
+
+  while (cur > max && !__atomic_compare_exchange_n(&max_in_use, &max, cur,
+        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  unsigned long start = now_ns();
+  fibril_sleep_ns(HOLD_NS);
+  if (now_ns() - start < HOLD_NS) __atomic_add_fetch(&early, 1,
+      __ATOMIC_RELAXED);
+
+  __atomic_sub_fetch(&in_use, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&units, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+static fibril void spawn(int lo, int hi)
+{
+  if (hi - lo == 1) {
+    task();
+    return;
+  }
+
+  int mid = lo + (hi - lo) / 2;
+
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibril_fork(&fr, spawn, (lo, mid));
+  spawn(mid, hi);
+
+  fibril_join(&fr);
+}
+
+void init() {}
+
+void prep()
+{
+  units = CAPACITY;
+  in_use = 0;
+  max_in_use = 0;
+  early = 0;
+  done = 0;
+}
+
+void test()
+{
+  spawn(0, n);
+}
+
+int verify()
+{
+  if (done != n || max_in_use > CAPACITY || early || units != CAPACITY) {
+    printf("done: %d (expected %d) max in use: %d (capacity %d) "
+        "early wakeups: %d\n", done, n, max_in_use, CAPACITY, early);
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,7 +1,45 @@
+/*
+ * Fork trees of fib.
+ *
+ * Built with -DPRESSURE, the test points FIBRIL_PRESSURE at a file of its
+ * own that mimics /proc/pressure/memory. prep() steps the file through
+ * full, some and no pressure, one level per run, and leaves the runtime a
+ * few periods to read it before the run starts. In a stats build with more
+ * than one worker, verify() checks that steals were deferred.
+ *
+ * Built with -DCORES, init() points FIBRIL_SHARE_CORES at a segment of its
+ * own and forks a few copies of the test before the runtime starts, so
+ * that every process runs the fork tree with a runtime of its own, all of
+ * them handing the same tokens around. verify() in the first process
+ * collects the results of the others, and checks that the last runtime
+ * to detach has unlinked the segment.
+ *
+ * Other backends ignore the file and the segment.
+ */
+
 #include <stdio.h>
 #include "test.h"
 
+#if defined(PRESSURE) || defined(CORES)
+#include <unistd.h>
+#endif
+
+#ifdef CORES
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+#if defined(PRESSURE) || defined(CORES)
+#ifndef BENCHMARK
+int n = 24;
+#else
+int n = 32;
+#endif
+#else
 int n = 42;
+#endif
+
 int m;
 
 static int fib_fast(int n)
@@ -26,6 +64,7 @@ fibril int fib(int n)
   int x, y;
   fibril_t fr;
   fibril_init(&fr);
+  fibril_stack_hint(&fr, 0x10000);
 
   fibril_fork(&fr, &x, fib, (n - 1));
 
@@ -35,6 +74,137 @@ fibril int fib(int n)
   return x + y;
 }
 
+#ifdef PRESSURE
+
+static char path[] = "/tmp/fibril-pressure-XXXXXX";
+static int level;
+static int nprocs;
+static int errors;
+
+static void pressure(double some, double full)
+{
+  FILE * file = fopen(path, "w");
+  if (!file) return;
+
+  fprintf(file, "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n", some);
+  fprintf(file, "full avg10=%.2f avg60=0.00 avg300=0.00 total=0\n", full);
+  fclose(file);
+}
+
+void init()
+{
+  int fd = mkstemp(path);
+  if (fd >= 0) close(fd);
+
+  setenv("FIBRIL_PRESSURE", path, 1);
+  pressure(0, 0);
+}
+
+void prep()
+{
+  static const double levels[][2] = { { 80, 40 }, { 40, 0 }, { 0, 0 } };
+
+  pressure(levels[level][0], levels[level][1]);
+  level = (level + 1) % 3;
+  nprocs = fibril_rt_nprocs();
+
+  /** The monitor reads the file every 100 ms. */
+  usleep(300000);
+}
+
+void test()
+{
+  m = fib(n);
+  if (m != fib_fast(n)) errors++;
+}
+
+int verify()
+{
+  unlink(path);
+
+  if (errors) {
+    printf("fib(%d) went wrong under pressure %d times\n", n, errors);
+    return 1;
+  }
+
+#if defined(FIBRIL_STATS) && defined(FIBRILE_H)
+  char * pressured = getenv("FIBRIL_N_PRESSURED");
+
+  if (nprocs > 1 && (!pressured || atol(pressured) == 0)) {
+    printf("no steal was deferred under pressure\n");
+    return 1;
+  }
+#endif
+
+  return 0;
+}
+
+#elif defined(CORES)
+
+#define COPIES 3
+
+static char name[64];
+static pid_t copies[COPIES];
+static int copy;
+
+void init()
+{
+  snprintf(name, sizeof(name), "/fibril-cores-%d", getpid());
+  setenv("FIBRIL_SHARE_CORES", name, 1);
+
+  int i;
+  for (i = 0; i < COPIES; ++i) {
+    copies[i] = fork();
+
+    if (copies[i] == 0) {
+      copy = i + 1;
+      break;
+    }
+  }
+}
+
+void prep() {}
+
+void test()
+{
+  m = fib(n);
+}
+
+int verify()
+{
+  int errors = m != fib_fast(n);
+
+  if (copy) return errors;
+
+  int i;
+  for (i = 0; i < COPIES; ++i) {
+    int status;
+
+    if (copies[i] < 0 || waitpid(copies[i], &status, 0) != copies[i] ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) errors++;
+  }
+
+  if (errors) {
+    printf("fib(%d) went wrong in %d of %d processes\n", n, errors,
+        COPIES + 1);
+    return 1;
+  }
+
+  /** The last runtime to detach unlinks the segment. */
+  int fd = shm_open(name, O_RDONLY, 0);
+
+  if (fd >= 0) {
+    close(fd);
+    shm_unlink(name);
+    printf("%s outlived the runtimes\n", name);
+    return 1;
+  }
+
+  return 0;
+}
+
+#else
+
 int verify()
 {
   int expect = fib_fast(n);
@@ -54,3 +224,4 @@ void test() {
   m = fib(n);
 }
 
+#endif
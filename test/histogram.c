@@ -0,0 +1,157 @@
+/*
+ * Histogram of an array with blocking synchronization between fibrils.
+ *
+ * Every leaf borrows one of a few scratch buffers (a semaphore counts the
+ * free ones and a mutex protects the free list), counts its range into the
+ * buffer and merges it into the shared histogram under another mutex. The
+ * reporter runs in the continuation of the leaves and waits on a latch that
+ * every leaf counts down, so it only parks when the continuation is stolen,
+ * and snapshots the histogram once the last leaf has merged.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include <fibril/lock.h>
+
+#ifndef BENCHMARK
+int n = 1 << 20;
+#else
+int n = 1 << 27;
+#endif
+
+#define BINS 256
+#define LEAF_SIZE 4096
+#define NBUFFERS 4
+
+static unsigned char * a;
+static long hist[BINS];
+static long result[BINS];
+static long expected[BINS];
+
+static long * buffers[NBUFFERS];
+static int nfree;
+
+static fibril_mutex_t hist_lock;
+static fibril_mutex_t free_lock;
+static fibril_semaphore_t free_count;
+static fibril_latch_t done;
+
+static void leaf(int lo, int hi)
+{
+  long * buf;
+  int i;
+
+  fibril_semaphore_wait(&free_count);
+
+  fibril_mutex_lock(&free_lock);
+  buf = buffers[--nfree];
+  fibril_mutex_unlock(&free_lock);
+
+  memset(buf, 0, sizeof(long) * BINS);
+  for (i = lo; i < hi; ++i) buf[a[i]]++;
+
+  fibril_mutex_lock(&hist_lock);
+  for (i = 0; i < BINS; ++i) hist[i] += buf[i];
+  fibril_mutex_unlock(&hist_lock);
+
+  fibril_mutex_lock(&free_lock);
+  buffers[nfree++] = buf;
+  fibril_mutex_unlock(&free_lock);
+
+  fibril_semaphore_post(&free_count);
+  fibril_latch_count_down(&done, 1);
+}
+
+static fibril void histogram(int lo, int hi)
+{
+  if (hi - lo <= LEAF_SIZE) {
+    leaf(lo, hi);
+    return;
+  }
+
+  int mid = lo + (hi - lo) / 2;
+
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibril_fork(&fr, histogram, (lo, mid));
+  histogram(mid, hi);
+
+  fibril_join(&fr);
+}
+
+static fibril void report(void)
+{
+  fibril_latch_wait(&done);
+  memcpy(result, hist, sizeof(hist));
+}
+
+static fibril void run(void)
+{
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibril_fork(&fr, histogram, (0, n));
+  report();
+
+  fibril_join(&fr);
+}
+
+static int count_leaves(int lo, int hi)
+{
+  if (hi - lo <= LEAF_SIZE) return 1;
+
+  int mid = lo + (hi - lo) / 2;
+  return count_leaves(lo, mid) + count_leaves(mid, hi);
+}
+
+void init()
+{
+  unsigned long seed = 1;
+  int i;
+
+  a = (unsigned char *) malloc(n);
+
+  for (i = 0; i < n; ++i) {
+    seed = seed * 6364136223846793005UL + 1;
+    a[i] = (seed >> 33) % BINS;
+    expected[a[i]]++;
+  }
+
+  for (i = 0; i < NBUFFERS; ++i) {
+    buffers[i] = (long *) malloc(sizeof(long) * BINS);
+  }
+
+  fibril_mutex_init(&hist_lock);
+  fibril_mutex_init(&free_lock);
+}
+
+void prep()
+{
+  memset(hist, 0, sizeof(hist));
+  memset(result, 0, sizeof(result));
+  nfree = NBUFFERS;
+
+  fibril_semaphore_init(&free_count, NBUFFERS);
+  fibril_latch_init(&done, count_leaves(0, n));
+}
+
+void test()
+{
+  run();
+}
+
+int verify()
+{
+  int i;
+
+  for (i = 0; i < BINS; ++i) {
+    if (result[i] != expected[i]) {
+      printf("bin %d: %ld (expected %ld)\n", i, result[i], expected[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -76,6 +76,7 @@ static struct item items[] = {
 };
 
 static int best_so_far = INT_MIN;
+static long n_cancelled;
 
 static int compare(struct item *a, struct item *b)
 {
@@ -105,6 +106,12 @@ fibril static int knapsack(struct item *e, int c, int n, int v)
   if (n == 0 || c == 0)
     return v;		/* feasible solution, with value v */
 
+  /* a sibling already reached the bound of this branch */
+  if (fibril_cancelled()) {
+    __atomic_fetch_add(&n_cancelled, 1, __ATOMIC_RELAXED);
+    return INT_MIN;
+  }
+
   ub = (double) v + c * e->value / e->weight;
 
 #ifdef __SYNC
@@ -119,6 +126,9 @@ fibril static int knapsack(struct item *e, int c, int n, int v)
   fibril_t fr;
   fibril_init(&fr);
 
+  fibril_token_t tk;
+  fibril_token_init(&fr, &tk);
+
 #ifdef __REVERSE_EXEC_ORDER
   /* compute the best solution with the current item in the knapsack */
   fibril_fork(&fr, &with, knapsack, (e + 1, c - e->weight, n - 1, v + e->value));
@@ -129,6 +139,14 @@ fibril static int knapsack(struct item *e, int c, int n, int v)
   fibril_fork(&fr, &without, knapsack, (e + 1, c, n - 1, v));
   /* compute the best solution with the current item in the knapsack */
   with = knapsack(e + 1, c - e->weight, n - 1, v + e->value);
+
+  /*
+   * the items are sorted by value/weight, so no solution without the
+   * current item can exceed this bound: stop the forked branch if the
+   * solution with the item already reaches it.
+   */
+  if (n > 1 && with >= (double) v + c * e[1].value / e[1].weight)
+    fibril_cancel(&tk);
 #endif
 
   fibril_join(&fr);
@@ -170,6 +188,7 @@ void prep()
 #else
   best_so_far = INT_MIN;
 #endif
+  n_cancelled = 0;
 }
 
 void test()
@@ -181,6 +200,10 @@ int verify()
 {
   int expected = 733;
 
+#if defined(BENCHMARK) && !defined(CSV)
+  printf("  # of cancelled branches: %ld\n", n_cancelled);
+#endif
+
   if (sol != expected) {
     printf("sol: %d (expected: %d)\n", sol, expected);
     return 1;
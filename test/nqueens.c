@@ -26,6 +26,7 @@ fibril static int nqueens(const int * a, int n, int d, int i)
 
   fibril_t fr;
   fibril_init(&fr);
+  fibril_stack_hint(&fr, 0x10000);
 
   for (i = 0; i < n; ++i) {
     fibril_fork(&fr, &res[i], nqueens, (a, n, d, i));
@@ -0,0 +1,81 @@
+/*
+ * Fork trees over every size class of the stack pool.
+ *
+ * Every node of a binary tree of depth n stamps a frame of its own, forks
+ * its children with a stack hint that cycles through the size classes,
+ * and checks the stamps once they have joined, which catches a stack that
+ * is handed out twice while a continuation still runs on it. In a stats
+ * build, verify() also checks that the steals took stacks from the pool,
+ * and no more than two per steal: one reserved and one set up. Other
+ * backends ignore the hints.
+ */
+
+#include <stdio.h>
+#include "test.h"
+
+#ifndef BENCHMARK
+int n = 16;
+#else
+int n = 20;
+#endif
+
+#define STAMPS 8
+
+static const unsigned long hints[] = { 0, 0x40000, 0x10000 };
+static int errors;
+
+static fibril void storm(int depth, long id)
+{
+  volatile long stamps[STAMPS];
+  int i;
+
+  for (i = 0; i < STAMPS; ++i) stamps[i] = id;
+  if (depth == 0) return;
+
+  fibril_t fr;
+  fibril_init(&fr);
+  fibril_stack_hint(&fr, hints[depth % 3]);
+
+  fibril_fork(&fr, storm, (depth - 1, 2 * id));
+  storm(depth - 1, 2 * id + 1);
+
+  fibril_join(&fr);
+
+  for (i = 0; i < STAMPS; ++i) {
+    if (stamps[i] != id) __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void init() {}
+
+void prep()
+{
+  errors = 0;
+}
+
+void test()
+{
+  storm(n, 1);
+}
+
+int verify()
+{
+  if (errors) {
+    printf("stacks handed out twice: %d\n", errors);
+    return 1;
+  }
+
+#if defined(FIBRIL_STATS) && defined(FIBRILE_H)
+  char * steals = getenv("FIBRIL_N_STEALS");
+  char * stacks = getenv("FIBRIL_N_STACKS");
+  long nsteals = steals ? atol(steals) : 0;
+  long nstacks = stacks ? atol(stacks) : 0;
+
+  if ((nsteals > 0 && nstacks == 0) || nstacks > 2 * nsteals) {
+    printf("%ld stacks for %ld steals\n", nstacks, nsteals);
+    return 1;
+  }
+#endif
+
+  return 0;
+}
@@ -29,8 +29,12 @@ extern int n;
 #include <stdio.h>
 #include <float.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 static void sort(float * a, int n)
 {
@@ -57,6 +61,76 @@ size_t static inline time_elapsed(size_t val)
   return t.tv_sec * 1000000 + t.tv_usec - val;
 }
 
+#ifndef CSV
+
+/**
+ * Hardware counters of the timed runs, or -1 where perf events are not
+ * available. They are opened disabled before the workers are created so
+ * that the workers inherit them, and read after the workers have exited,
+ * since that is when their counts are added up.
+ */
+static struct {
+  const char * name;
+  unsigned int type;
+  unsigned long config;
+  int fd;
+} perf[] = {
+  { "dTLB load misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1 },
+  { "cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+};
+
+#define PERF_COUNT (sizeof(perf) / sizeof(perf[0]))
+
+static void perf_open(void)
+{
+  struct perf_event_attr attr;
+  int i;
+
+  for (i = 0; i < PERF_COUNT; ++i) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf[i].type;
+    attr.config = perf[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static inline void perf_enable(int on)
+{
+  int i;
+
+  for (i = 0; i < PERF_COUNT; ++i) {
+    if (perf[i].fd >= 0) {
+      ioctl(perf[i].fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE,
+          0);
+    }
+  }
+}
+
+static void perf_print(void)
+{
+  long count;
+  int i;
+
+  for (i = 0; i < PERF_COUNT; ++i) {
+    if (perf[i].fd < 0 ||
+        read(perf[i].fd, &count, sizeof(count)) != sizeof(count)) {
+      printf("    # of %s: n/a\n", perf[i].name);
+    } else {
+      printf("    # of %s: %ld\n", perf[i].name, count);
+    }
+  }
+}
+
+#endif
+
 static void bench(const char * name, int nprocs)
 {
   static int iter = MAXRUNS;
@@ -83,6 +157,7 @@ static void bench(const char * name, int nprocs)
   }
 
   /* benchmark */
+  perf_enable(1);
   for (int i = 0; i < iter; ++i) {
     prep();
     size_t usecs = time_elapsed(0);
@@ -92,6 +167,8 @@ static void bench(const char * name, int nprocs)
     printf("  #%d execution time: %f s\n", i, times[i]);
   }
 
+  perf_enable(0);
+
   sort(times, iter);
 
   float p10 = times[(int) (0.5f + ((float) iter / 10.0f))];
@@ -148,6 +225,45 @@ static void bench(const char * name, int nprocs)
 
 #endif
 
+#if defined(ELASTIC) && !defined(BENCHMARK)
+
+#include <unistd.h>
+
+/**
+ * With ELASTIC, the test runs while the main fibril changes the number of
+ * workers every millisecond, from all of them down to one and back up. It
+ * blocks its worker in usleep() rather than fibril_sleep_ns(), whose timer
+ * only fires once that worker is idle. Benchmark builds time the test as
+ * it is.
+ */
+static int volatile elastic_done;
+
+fibril static void elastic_test(int unused __attribute__((unused)))
+{
+  test();
+  elastic_done = 1;
+}
+
+fibril static void elastic(int nprocs)
+{
+  fibril_t fr;
+  fibril_init(&fr);
+
+  fibril_fork(&fr, elastic_test, (0));
+
+  int i;
+  for (i = 0; !elastic_done; ++i) {
+    int k = i % (2 * nprocs);
+    fibril_rt_set_nprocs(k < nprocs ? nprocs - k : k - nprocs + 1);
+    usleep(1000);
+  }
+
+  fibril_join(&fr);
+  fibril_rt_set_nprocs(nprocs);
+}
+
+#endif
+
 #include <stdlib.h>
 
 int main(int argc, const char * argv[])
@@ -162,11 +278,18 @@ int main(int argc, const char * argv[])
   char *env = getenv("BENCHMARK_NPROCS");
   if (env) nthreads = atoi(env);
 
+#if defined(BENCHMARK) && !defined(CSV)
+  perf_open();
+#endif
+
   fibril_rt_init(nthreads);
   int nprocs = fibril_rt_nprocs();
 
 #ifdef BENCHMARK
   bench(argv[0], nprocs);
+#elif defined(ELASTIC)
+  prep();
+  elastic(nprocs);
 #else
   prep();
   test();
@@ -175,12 +298,34 @@ int main(int argc, const char * argv[])
   fibril_rt_exit();
 
 #ifdef BENCHMARK
+#ifndef CSV
+  perf_print();
+#endif
 #ifdef FIBRIL_STATS
   printf("  Statistics summary:\n");
   printf("    # of steals: %s\n", getenv("FIBRIL_N_STEALS"));
   printf("    # of suspensions: %s\n", getenv("FIBRIL_N_SUSPENSIONS"));
   printf("    # of stacks used: %s\n", getenv("FIBRIL_N_STACKS"));
   printf("    # of pages used: %s\n", getenv("FIBRIL_N_PAGES"));
+  printf("    # of cancelled steals (THE deque): %s\n", getenv("FIBRIL_N_CANCELS"));
+  printf("    # of madvise calls: %s\n", getenv("FIBRIL_N_MADVISE"));
+  printf("    # of madvise calls saved: %s\n",
+      getenv("FIBRIL_N_MADVISE_SAVED"));
+  printf("    # of stacks trimmed: %s\n", getenv("FIBRIL_N_TRIMMED"));
+  printf("    # of stacks from other nodes: %s\n",
+      getenv("FIBRIL_N_REMOTE_STACKS"));
+  printf("    # of stacks returned to their owners: %s\n",
+      getenv("FIBRIL_N_REMOTE_FREES"));
+  printf("    # of steals throttled for want of a stack: %s\n",
+      getenv("FIBRIL_N_THROTTLED"));
+  printf("    # of steals deferred by memory pressure: %s\n",
+      getenv("FIBRIL_N_PRESSURED"));
+  printf("    # of stack growths: %s\n", getenv("FIBRIL_N_GROWS"));
+  printf("    # of idle parks: %s\n", getenv("FIBRIL_N_PARKS"));
+  if (getenv("FIBRIL_RESIDENT_PAGES")) {
+    printf("    resident pages of suspended stacks per worker (peak/avg): "
+        "%s\n", getenv("FIBRIL_RESIDENT_PAGES"));
+  }
 #endif
 #ifndef CSV
   printf("===========================================\n");
@@ -0,0 +1,369 @@
+/****************************************************************************\
+ * Tiled LU decomposition as a dataflow task graph.
+ *
+ * Same matrix layout, block kernels and result check as lu.c, but the
+ * factorization is a right-looking tiled algorithm whose tasks only wait for
+ * the tiles they actually read, instead of the fork-join phases of the
+ * recursive version.
+\****************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include <fibril/graph.h>
+
+/* Define the size of a block. */
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 16
+#endif
+
+/* Define the default matrix size and the size of a tile in blocks. */
+#ifndef DEFAULT_SIZE
+#ifndef BENCHMARK
+#define DEFAULT_SIZE (16 * BLOCK_SIZE)
+#define TILE_BLOCKS 2
+#else
+#define DEFAULT_SIZE 4096
+#define TILE_BLOCKS 8
+#endif
+#endif
+
+#ifndef TILE_BLOCKS
+#define TILE_BLOCKS 4
+#endif
+
+/* A block is a 2D array of doubles. */
+typedef double Block[BLOCK_SIZE][BLOCK_SIZE];
+#define BLOCK(B,I,J) (B[I][J])
+
+/* A matrix is a 1D array of blocks. */
+typedef Block * Matrix;
+#define MATRIX(M,I,J) ((M)[(I)*nBlocks+(J)])
+
+/* Block (I,J) of tile (TI,TJ). */
+#define TILE(M,TI,TJ,I,J) \
+  MATRIX(M, (TI) * TILE_BLOCKS + (I), (TJ) * TILE_BLOCKS + (J))
+
+/** Matrix size. */
+int n = DEFAULT_SIZE;
+
+/** The global matrix and a copy of the matrix. */
+static Matrix M;
+#ifndef BENCHMARK
+static Matrix Msave;
+#endif
+
+/* Matrix size in blocks and in tiles. */
+static int nBlocks;
+static int nTiles;
+
+/****************************************************************************\
+ * Utility routines.
+ \****************************************************************************/
+
+static void init_matrix(Matrix M, int nb)
+{
+  int I, J, K, i, j, k;
+
+  srand(1);
+
+  for (I = 0; I < nb; I++)
+    for (J = 0; J < nb; J++)
+      for (i = 0; i < BLOCK_SIZE; i++)
+        for (j = 0; j < BLOCK_SIZE; j++)
+          BLOCK(MATRIX(M, I, J), i, j) = ((double)rand()) / (double)RAND_MAX;
+
+  for (K = 0; K < nb; K++)
+    for (k = 0; k < BLOCK_SIZE; k++)
+      BLOCK(MATRIX(M, K, K), k, k) *= 10.0;
+}
+
+#ifndef BENCHMARK
+static int test_result(Matrix LU, Matrix M, int nb)
+{
+  int I, J, K, i, j, k;
+  double diff, max_diff;
+  double v;
+
+  max_diff = 0.0;
+
+  for (i = 0; i < nb * BLOCK_SIZE; i++)
+    for (j = 0; j < nb * BLOCK_SIZE; j++) {
+      I = i / BLOCK_SIZE;
+      J = j / BLOCK_SIZE;
+      v = 0.0;
+      for (k = 0; k < i && k <= j; k++) {
+        K = k / BLOCK_SIZE;
+        v += BLOCK(MATRIX(LU, I, K), i % BLOCK_SIZE,
+            k % BLOCK_SIZE) *
+          BLOCK(MATRIX(LU, K, J), k % BLOCK_SIZE,
+              j % BLOCK_SIZE);
+      }
+      if (k == i && k <= j) {
+        K = k / BLOCK_SIZE;
+        v += BLOCK(MATRIX(LU, K, J), k % BLOCK_SIZE,
+            j % BLOCK_SIZE);
+      }
+      diff = fabs(BLOCK(MATRIX(M, I, J), i % BLOCK_SIZE,
+            j % BLOCK_SIZE) - v);
+      if (diff > max_diff)
+        max_diff = diff;
+    }
+
+  return (max_diff > 0.00001);
+}
+#endif
+
+/****************************************************************************\
+ * Block operations.
+ \****************************************************************************/
+
+static void elem_daxmy(double a, double *x, double *y, int n)
+{
+  for (n--; n >= 0; n--) y[n] -= a * x[n];
+}
+
+static void block_lu(Block B)
+{
+  int i, k;
+
+  for (k = 0; k < BLOCK_SIZE; k++)
+    for (i = k + 1; i < BLOCK_SIZE; i++) {
+      BLOCK(B, i, k) /= BLOCK(B, k, k);
+      elem_daxmy(BLOCK(B, i, k), &BLOCK(B, k, k + 1),
+          &BLOCK(B, i, k + 1), BLOCK_SIZE - k - 1);
+    }
+}
+
+static void block_lower_solve(Block B, Block L)
+{
+  int i, k;
+
+  for (i = 1; i < BLOCK_SIZE; i++)
+    for (k = 0; k < i; k++)
+      elem_daxmy(BLOCK(L, i, k), &BLOCK(B, k, 0),
+          &BLOCK(B, i, 0), BLOCK_SIZE);
+}
+
+static void block_upper_solve(Block B, Block U)
+{
+  int i, k;
+
+  for (i = 0; i < BLOCK_SIZE; i++)
+    for (k = 0; k < BLOCK_SIZE; k++) {
+      BLOCK(B, i, k) /= BLOCK(U, k, k);
+      elem_daxmy(BLOCK(B, i, k), &BLOCK(U, k, k + 1),
+          &BLOCK(B, i, k + 1), BLOCK_SIZE - k - 1);
+    }
+}
+
+static void block_schur(Block B, Block A, Block C)
+{
+  int i, k;
+
+  for (i = 0; i < BLOCK_SIZE; i++)
+    for (k = 0; k < BLOCK_SIZE; k++)
+      elem_daxmy(BLOCK(A, i, k), &BLOCK(C, k, 0),
+          &BLOCK(B, i, 0), BLOCK_SIZE);
+}
+
+/****************************************************************************\
+ * Tile operations.
+ \****************************************************************************/
+
+typedef struct {
+  int i, j, k;
+} Task;
+
+/* tile_lu - Factor the diagonal tile (k,k). */
+static void tile_lu(void * arg)
+{
+  Task * t = (Task *) arg;
+  int k = t->k;
+  int I, J, K;
+
+  for (K = 0; K < TILE_BLOCKS; K++) {
+    block_lu(TILE(M, k, k, K, K));
+
+    for (J = K + 1; J < TILE_BLOCKS; J++)
+      block_lower_solve(TILE(M, k, k, K, J), TILE(M, k, k, K, K));
+
+    for (I = K + 1; I < TILE_BLOCKS; I++)
+      block_upper_solve(TILE(M, k, k, I, K), TILE(M, k, k, K, K));
+
+    for (I = K + 1; I < TILE_BLOCKS; I++)
+      for (J = K + 1; J < TILE_BLOCKS; J++)
+        block_schur(TILE(M, k, k, I, J), TILE(M, k, k, I, K),
+            TILE(M, k, k, K, J));
+  }
+}
+
+/* tile_lower_solve - Solve L X = M for tile (k,j) with L from tile (k,k). */
+static void tile_lower_solve(void * arg)
+{
+  Task * t = (Task *) arg;
+  int j = t->j, k = t->k;
+  int I, J, K;
+
+  for (K = 0; K < TILE_BLOCKS; K++)
+    for (J = 0; J < TILE_BLOCKS; J++) {
+      block_lower_solve(TILE(M, k, j, K, J), TILE(M, k, k, K, K));
+
+      for (I = K + 1; I < TILE_BLOCKS; I++)
+        block_schur(TILE(M, k, j, I, J), TILE(M, k, k, I, K),
+            TILE(M, k, j, K, J));
+    }
+}
+
+/* tile_upper_solve - Solve X U = M for tile (i,k) with U from tile (k,k). */
+static void tile_upper_solve(void * arg)
+{
+  Task * t = (Task *) arg;
+  int i = t->i, k = t->k;
+  int I, J, K;
+
+  for (K = 0; K < TILE_BLOCKS; K++)
+    for (I = 0; I < TILE_BLOCKS; I++) {
+      block_upper_solve(TILE(M, i, k, I, K), TILE(M, k, k, K, K));
+
+      for (J = K + 1; J < TILE_BLOCKS; J++)
+        block_schur(TILE(M, i, k, I, J), TILE(M, i, k, I, K),
+            TILE(M, k, k, K, J));
+    }
+}
+
+/* tile_schur - Compute tile (i,j) -= tile (i,k) * tile (k,j). */
+static void tile_schur(void * arg)
+{
+  Task * t = (Task *) arg;
+  int i = t->i, j = t->j, k = t->k;
+  int I, J, K;
+
+  for (I = 0; I < TILE_BLOCKS; I++)
+    for (J = 0; J < TILE_BLOCKS; J++)
+      for (K = 0; K < TILE_BLOCKS; K++)
+        block_schur(TILE(M, i, j, I, J), TILE(M, i, k, I, K),
+            TILE(M, k, j, K, J));
+}
+
+/****************************************************************************\
+ * Task graph construction.
+ \****************************************************************************/
+
+static fibril_node_t * nodes;
+static Task * tasks;
+static int nTasks;
+
+/* Last task that wrote tile (i,j). */
+static Task ** last;
+#define LAST(i,j) (last[(i) * nTiles + (j)])
+
+static Task * add_task(void (*fn)(void *), int i, int j, int k)
+{
+  Task * t = &tasks[nTasks];
+
+  t->i = i;
+  t->j = j;
+  t->k = k;
+  fibril_node_init(&nodes[nTasks], fn, t);
+  nTasks++;
+
+  return t;
+}
+
+#define NODE(t) (&nodes[(t) - tasks])
+
+static void depend(Task * t, Task * pred)
+{
+  if (pred && fibril_node_depend(NODE(t), NODE(pred)) != FIBRIL_SUCCESS) {
+    abort();
+  }
+}
+
+static void build_graph(void)
+{
+  int i, j, k, size = 0;
+
+  for (k = 0; k < nTiles; k++) {
+    int r = nTiles - k - 1;
+    size += 1 + 2 * r + r * r;
+  }
+
+  tasks = (Task *) malloc(sizeof(Task) * size);
+  nodes = (fibril_node_t *) malloc(sizeof(fibril_node_t) * size);
+  last = (Task **) calloc(nTiles * nTiles, sizeof(Task *));
+  nTasks = 0;
+
+  for (k = 0; k < nTiles; k++) {
+    Task * t = add_task(tile_lu, k, k, k);
+    depend(t, LAST(k, k));
+    LAST(k, k) = t;
+
+    for (j = k + 1; j < nTiles; j++) {
+      Task * s = add_task(tile_lower_solve, k, j, k);
+      depend(s, LAST(k, k));
+      depend(s, LAST(k, j));
+      LAST(k, j) = s;
+    }
+
+    for (i = k + 1; i < nTiles; i++) {
+      Task * s = add_task(tile_upper_solve, i, k, k);
+      depend(s, LAST(k, k));
+      depend(s, LAST(i, k));
+      LAST(i, k) = s;
+    }
+
+    for (i = k + 1; i < nTiles; i++)
+      for (j = k + 1; j < nTiles; j++) {
+        Task * s = add_task(tile_schur, i, j, k);
+        depend(s, LAST(i, k));
+        depend(s, LAST(k, j));
+        depend(s, LAST(i, j));
+        LAST(i, j) = s;
+      }
+  }
+
+  free(last);
+}
+
+void init()
+{
+  nBlocks = n / BLOCK_SIZE;
+  nTiles = nBlocks / TILE_BLOCKS;
+  nBlocks = nTiles * TILE_BLOCKS;
+  n = nBlocks * BLOCK_SIZE;
+
+  M = (Matrix) malloc(n * n * sizeof(double));
+  init_matrix(M, nBlocks);
+#ifndef BENCHMARK
+  Msave = (Matrix) malloc(n * n * sizeof(double));
+  memcpy((void *) Msave, (void *) M, n * n * sizeof(double));
+#endif
+
+  build_graph();
+}
+
+void prep()
+{
+#ifndef BENCHMARK
+  memcpy((void *) M, (void *) Msave, n * n * sizeof(double));
+#endif
+}
+
+void test()
+{
+  fibril_graph_run(nodes, nTasks);
+}
+
+int verify()
+{
+  fibril_graph_free(nodes, nTasks);
+
+#ifndef BENCHMARK
+  return test_result(M, Msave, nBlocks);
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,183 @@
+/*
+ * Word count over a local file as a three-stage pipeline:
+ * parse (serial) -> transform (parallel) -> aggregate (serial).
+ *
+ * The parse stage reads the file in chunks that end at a line break, the
+ * transform stage counts and hashes the words of a chunk, and the aggregate
+ * stage folds the chunks into an order-dependent checksum, so that an
+ * out-of-order serial stage would fail verification.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include <fibril/pipeline.h>
+
+#ifndef BENCHMARK
+int n = 200000;
+#else
+int n = 8000000;
+#endif
+
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_LINE 256
+
+#ifndef IN_FLIGHT
+#define IN_FLIGHT 32
+#endif
+
+typedef struct {
+  size_t size;
+  long lines;
+  long words;
+  unsigned long hash;
+  char buf[CHUNK_SIZE + MAX_LINE];
+} Chunk;
+
+typedef struct {
+  long lines;
+  long words;
+  unsigned long hash;
+} Total;
+
+static FILE * file;
+static Total total, expected;
+
+static void * parse(void * arg __attribute__((unused)),
+    void * item __attribute__((unused)))
+{
+  Chunk * c = (Chunk *) malloc(sizeof(Chunk));
+  int ch;
+
+  c->size = fread(c->buf, 1, CHUNK_SIZE, file);
+
+  /* Extend the chunk to the end of its last line, or by MAX_LINE bytes. */
+  if (c->size == CHUNK_SIZE) {
+    while (c->size < CHUNK_SIZE + MAX_LINE && (ch = getc(file)) != EOF) {
+      c->buf[c->size++] = ch;
+      if (ch == '\n') break;
+    }
+  }
+
+  if (c->size == 0) {
+    free(c);
+    return NULL;
+  }
+
+  return c;
+}
+
+static void * transform(void * arg __attribute__((unused)), void * item)
+{
+  Chunk * c = (Chunk *) item;
+  unsigned long h = 0;
+  size_t i;
+  int in_word = 0;
+
+  c->lines = 0;
+  c->words = 0;
+  c->hash = 0;
+
+  for (i = 0; i < c->size; ++i) {
+    char ch = c->buf[i];
+
+    if (ch == ' ' || ch == '\n') {
+      if (in_word) {
+        c->words++;
+        c->hash += h;
+        in_word = 0;
+      }
+      if (ch == '\n') c->lines++;
+    } else {
+      if (!in_word) {
+        h = 14695981039346656037UL;
+        in_word = 1;
+      }
+      h = (h ^ (unsigned char) ch) * 1099511628211UL;
+    }
+  }
+
+  if (in_word) {
+    c->words++;
+    c->hash += h;
+  }
+
+  return c;
+}
+
+static void * aggregate(void * arg, void * item)
+{
+  Chunk * c = (Chunk *) item;
+  Total * t = (Total *) arg;
+
+  t->lines += c->lines;
+  t->words += c->words;
+  t->hash = t->hash * 31 + c->hash;
+
+  free(c);
+  return t;
+}
+
+static const fibril_stage_t stages[] = {
+  { parse, FIBRIL_STAGE_SERIAL },
+  { transform, FIBRIL_STAGE_PARALLEL },
+  { aggregate, FIBRIL_STAGE_SERIAL }
+};
+
+void init()
+{
+  unsigned long seed = 1;
+  int i, j, k;
+
+  file = tmpfile();
+
+  for (i = 0; i < n; ++i) {
+    int nwords = 1 + (seed = seed * 6364136223846793005UL + 1) % 12;
+
+    for (j = 0; j < nwords; ++j) {
+      int len = 1 + (seed = seed * 6364136223846793005UL + 1) % 10;
+
+      for (k = 0; k < len; ++k) {
+        seed = seed * 6364136223846793005UL + 1;
+        putc('a' + (seed >> 33) % 26, file);
+      }
+
+      putc(j + 1 < nwords ? ' ' : '\n', file);
+    }
+  }
+
+  /* Compute the expected result serially. */
+  void * item;
+
+  rewind(file);
+  while ((item = parse(NULL, NULL))) {
+    aggregate(&expected, transform(NULL, item));
+  }
+}
+
+void prep()
+{
+  rewind(file);
+  memset(&total, 0, sizeof(Total));
+}
+
+void test()
+{
+  fibril_pipeline(stages, 3, IN_FLIGHT, &total);
+}
+
+int verify()
+{
+  fclose(file);
+
+  if (total.lines != expected.lines || total.words != expected.words ||
+      total.hash != expected.hash) {
+    printf("lines: %ld (expected: %ld) words: %ld (expected: %ld) "
+        "hash: %lx (expected: %lx)\n", total.lines, expected.lines,
+        total.words, expected.words, total.hash, expected.hash);
+    return 1;
+  }
+
+  return 0;
+}